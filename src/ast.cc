@@ -2,6 +2,32 @@
 
 struct Expr;
 
+/* Where a variable lives at runtime, as worked out by the Resolver.
+ * Anything it couldn't place (globals, imports) is looked up by name.
+ */
+enum Address_Kind {
+	// Looked up by name
+	ADDRESS_GLOBAL,
+	// `slot` of the current call frame, which lives on the VM stack
+	ADDRESS_FRAME,
+	// `slot` of the environment `depth` steps up from the current one
+	ADDRESS_ENVIRONMENT,
+};
+
+struct Local_Address {
+	Address_Kind kind;
+	int depth;
+	int slot;
+	static Local_Address global()
+	{
+		return (Local_Address) { ADDRESS_GLOBAL, -1, -1 };
+	}
+	bool is_local()
+	{
+		return kind != ADDRESS_GLOBAL;
+	}
+};
+
 enum Stmt_Kind {
 	STMT_LET,
 	STMT_SET,
@@ -13,6 +39,7 @@ enum Stmt_Kind {
 struct Stmt_Let {
 	Symbol left;
 	Expr * right;
+	Local_Address address;
 	void destroy();
 };
 
@@ -81,6 +108,11 @@ enum Expr_Kind {
 	EXPR_ON,
 };
 
+struct Expr_Variable {
+	Symbol name;
+	Local_Address address;
+};
+
 struct Expr_Unary {
 	Operator op;
 	Expr * expr;
@@ -91,18 +123,28 @@ struct Expr_Binary {
 	Expr * left;
 	Operator op;
 	Expr * right;
+	// Whether both operands are known to be integers (see
+	// inference.cc)
+	bool integer_operands;
 	void destroy();
 };
 
 struct Expr_Scope {
 	List<Stmt*> body;
 	Expr * terminator;
+	// Whether a lambda closes over this scope's bindings, in which
+	// case it needs an environment of its own
+	bool captured;
+	int slot_count;
 	void destroy();
 };
 
 struct Expr_Lambda {
 	List<Symbol> parameters;
 	Expr * body;
+	// Whether any nested lambda closes over the frame itself
+	bool captured;
+	int slot_count;
 	//List<Stmt*> body;
 	void destroy();
 };
@@ -151,6 +193,8 @@ struct Expr_Loop {
 struct Expr_On {
 	Symbol to_bind;
 	Expr * body;
+	bool captured;
+	Local_Address address;
 	void destroy();
 };
 
@@ -159,7 +203,7 @@ struct Expr {
 	Assoc_Ptr assoc;
 	union {
 		int integer;
-		Symbol variable;
+		Expr_Variable variable;
 		Symbol string;
 		Expr_Unary unary;
 		Expr_Binary binary;
@@ -177,6 +221,9 @@ struct Expr {
 		Expr * expr = (Expr*) malloc(sizeof(Expr));
 		expr->kind = kind;
 		expr->assoc = assoc;
+		if (kind == EXPR_BINARY) {
+			expr->binary.integer_operands = false;
+		}
 		return expr;
 	}
 	void destroy()
@@ -1,30 +1,50 @@
 struct Blocks {
 	List<BC*> blocks;
 	List<size_t> sizes;
+	// How many local slots a block's call frame needs
+	List<size_t> slot_counts;
+	// Whether a block's frame needs a heap environment (because it's
+	// closed over) or can keep its slots on the VM stack
+	List<bool> frame_environments;
 	void init()
 	{
 		blocks.alloc();
 		sizes.alloc();
+		slot_counts.alloc();
+		frame_environments.alloc();
 	}
 	size_t make_block()
 	{
 		blocks.push(NULL);
 		sizes.push(0);
+		slot_counts.push(0);
+		frame_environments.push(true);
 		return blocks.size - 1;
 	}
 	size_t upcoming_block()
 	{
 		return blocks.size;
 	}
-	void finalize_block(size_t reference, BC * block, size_t size)
+	void finalize_block(size_t reference, BC * block, size_t size,
+						size_t slot_count, bool frame_environment)
 	{
 		blocks[reference] = block;
 		sizes[reference] = size;
+		slot_counts[reference] = slot_count;
+		frame_environments[reference] = frame_environment;
 	}
 	size_t size_block(size_t reference)
 	{
 		return sizes[reference];
 	}
+	size_t slots_block(size_t reference)
+	{
+		return slot_counts[reference];
+	}
+	bool frame_environment_block(size_t reference)
+	{
+		return frame_environments[reference];
+	}
 	BC * retrieve_block(size_t reference)
 	{
 		assert(blocks[reference]);
@@ -37,7 +57,10 @@ struct Blocks {
 		}
 		blocks.dealloc();
 		sizes.dealloc();
+		slot_counts.dealloc();
+		frame_environments.dealloc();
 	}
 };
 
-const char * load_and_compile_file(Blocks * blocks, const char * filename);
+const char * load_and_compile_file(Blocks * blocks, const char * filename,
+								   List<Symbol> * exports = NULL);
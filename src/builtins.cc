@@ -7,17 +7,24 @@
  * 1. Give the function an enum name in the Foreign_Function enum
  * 2. Add a CASE to lower_from_symbol that takes in your function name
  *    and returns your function enum.
- * 3. Add the argument count to the builtin_argument_counts array
+ * 3. Add the minimum and maximum argument counts to the
+ *    builtin_arities array (VARIADIC for no maximum)
  * 4. Add the function pointer to the builtin_funcptrs array
- * 
+ * 5. If there's an instruction that does the same thing, add it to
+ *    the builtin_intrinsics array, otherwise BC_NOP. The compiler uses
+ *    it in place of calls it can prove go to the builtin.
+ *
+ * Arguments are a view into the VM's stack, so builtins mustn't hold
+ * onto `args` after they return.
  */
 
-#define DEFINE(name) Value v_##name(Value * args)
+#define DEFINE(name) Value v_##name(Value * args, size_t count)
 #define NAMEOF(name) (v_##name)
-#define PULL_ONE(a) Value a = args[0]
-#define PULL_TWO(a, b) Value a = args[0], b = args[1]
-#define PULL_THREE(a, b, c) Value a = args[0], b = args[1], c = args[2]
-#define PULL_FOUR(a, b, c, d) Value a = args[0], b = args[1], c = args[2], d = args[3]
+#define ARG(i) (args[count - 1 - (i)])
+#define PULL_ONE(a) Value a = ARG(0)
+#define PULL_TWO(a, b) Value a = ARG(0), b = ARG(1)
+#define PULL_THREE(a, b, c) Value a = ARG(0), b = ARG(1), c = ARG(2)
+#define PULL_FOUR(a, b, c, d) Value a = ARG(0), b = ARG(1), c = ARG(2), d = ARG(3)
 
 namespace Builtins {
 	Map<Symbol, Builtin*> builtin_functions;
@@ -25,10 +32,10 @@ namespace Builtins {
 	DEFINE(abs)
 	{
 		PULL_ONE(n);
-		if (n.type != TYPE_INTEGER) {
+		if (!n.is(TYPE_INTEGER)) {
 			fatal("Builtin function abs() takes integer");
 		}
-		return Value::raise(abs(n.integer));
+		return Value::raise(abs(n.get_integer()));
 	}
 	DEFINE(mod)
 	{
@@ -36,43 +43,281 @@ namespace Builtins {
 		if (!n.is(TYPE_INTEGER) || !b.is(TYPE_INTEGER)) {
 			fatal("FFI function mod() takes integers");
 		}
-		return Value::raise(n.integer % b.integer);
+		return Value::raise(n.get_integer() % b.get_integer());
 	}
 	// IO functions
+	// Prints each argument, separated by spaces
+	void print_all(Value * args, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) {
+			char * s = ARG(i).to_string();
+			defer { free(s); };
+			printf(i == 0 ? "%s" : " %s", s);
+		}
+	}
 	DEFINE(print)
 	{
-		PULL_ONE(v);
-		char * s = v.to_string();
-		defer { free(s); };
-		printf("%s", s);
+		print_all(args, count);
 		return Value::nothing();
 	}
 	DEFINE(println)
 	{
-		PULL_ONE(v);
-		char * s = v.to_string();
-		defer { free(s); };
-		printf("%s\n", s);
+		print_all(args, count);
+		printf("\n");
 		return Value::nothing();
 	}	
+	// Makes an object with the given fields
+	Value object_of(const char ** names, Value * values, size_t count)
+	{
+		auto fields = (Symbol_ID*) malloc(sizeof(Symbol_ID) * count);
+		defer { free(fields); };
+		for (int i = 0; i < count; i++) {
+			fields[i] = Intern::id_of(Intern::intern(names[i]));
+		}
+		auto object = Object::alloc(Shapes::of(fields, count));
+		for (int i = 0; i < count; i++) {
+			object->fields[i] = values[i];
+		}
+		// Objects too big for the nursery start out old
+		GC::write_barrier(object);
+		return Value::raise(object);
+	}
+	// Array functions
+	DEFINE(array_new)
+	{
+		auto array = Array::alloc();
+		for (size_t i = 0; i < count; i++) {
+			array->push(ARG(i));
+		}
+		return Value::raise(array);
+	}
+	DEFINE(array_get)
+	{
+		PULL_TWO(a, i);
+		auto array = Array::checked(a, "array_get");
+		return array->get(array->checked_index(i));
+	}
+	DEFINE(array_set)
+	{
+		PULL_THREE(a, i, value);
+		auto array = Array::checked(a, "array_set");
+		array->set(array->checked_index(i), value);
+		return Value::nothing();
+	}
+	DEFINE(array_push)
+	{
+		PULL_TWO(a, value);
+		Array::checked(a, "array_push")->push(value);
+		return Value::nothing();
+	}
+	DEFINE(array_len)
+	{
+		PULL_ONE(a);
+		return Value::raise((int) Array::checked(a, "array_len")->length());
+	}
+	// Dictionary functions
+	Dict * checked_dict(Value value, const char * name)
+	{
+		if (!value.is(TYPE_DICT)) {
+			fatal("Builtin function %s() takes dictionary", name);
+		}
+		return value.get_dict();
+	}
+	Value checked_key(Value key)
+	{
+		if (!Dict::valid_key(key)) {
+			fatal("Dictionary keys must be integers, strings or symbols");
+		}
+		return key;
+	}
+	// Takes keys and values in turn
+	DEFINE(dict_new)
+	{
+		if (count % 2 != 0) {
+			fatal("Builtin function dict_new() takes keys and values in pairs");
+		}
+		auto dict = Dict::alloc();
+		for (size_t i = 0; i < count; i += 2) {
+			dict->put(checked_key(ARG(i)), ARG(i + 1));
+		}
+		return Value::raise(dict);
+	}
+	// Gives nothing for a missing key
+	DEFINE(dict_get)
+	{
+		PULL_TWO(d, key);
+		Value value;
+		if (!checked_dict(d, "dict_get")->lookup(checked_key(key), &value)) {
+			return Value::nothing();
+		}
+		return value;
+	}
+	DEFINE(dict_put)
+	{
+		PULL_THREE(d, key, value);
+		checked_dict(d, "dict_put")->put(checked_key(key), value);
+		return Value::nothing();
+	}
+	DEFINE(dict_has)
+	{
+		PULL_TWO(d, key);
+		Value value;
+		return Value::raise_bool(checked_dict(d, "dict_has")->lookup(checked_key(key), &value));
+	}
+	// Gives whether there was anything to remove
+	DEFINE(dict_remove)
+	{
+		PULL_TWO(d, key);
+		return Value::raise_bool(checked_dict(d, "dict_remove")->remove(checked_key(key)));
+	}
+	DEFINE(dict_len)
+	{
+		PULL_ONE(d);
+		return Value::raise((int) checked_dict(d, "dict_len")->count);
+	}
+	// For iterating over; both come out in the same order
+	Value dict_entries(Dict * dict, bool keys)
+	{
+		auto array = Array::alloc();
+		auto table = dict->table;
+		for (size_t i = 0; i < table->capacity; i++) {
+			auto entry = &table->entries[i];
+			if (entry->hash > Dict::TOMBSTONE) {
+				array->push(keys ? entry->key : entry->value);
+			}
+		}
+		return Value::raise(array);
+	}
+	DEFINE(dict_keys)
+	{
+		PULL_ONE(d);
+		return dict_entries(checked_dict(d, "dict_keys"), true);
+	}
+	DEFINE(dict_values)
+	{
+		PULL_ONE(d);
+		return dict_entries(checked_dict(d, "dict_values"), false);
+	}
+	// GC functions
+	// Integers are only 32 bits, so byte counts are given in KiB and
+	// anything too big is capped
+	Value stat(size_t n)
+	{
+		return Value::raise((int) (n > INT32_MAX ? INT32_MAX : n));
+	}
+	DEFINE(gc_stats)
+	{
+		auto stats = &GC::stats;
+		const char * bucket_names[GC::PAUSE_BUCKETS] = {
+			"under_10us", "under_100us", "under_1ms", "under_10ms", "under_100ms", "over_100ms",
+		};
+		Value buckets[GC::PAUSE_BUCKETS];
+		for (int i = 0; i < GC::PAUSE_BUCKETS; i++) {
+			buckets[i] = stat(stats->pause_histogram[i]);
+		}
+		auto histogram = object_of(bucket_names, buckets, GC::PAUSE_BUCKETS);
+		const char * names[] = {
+			"minor_collections", "major_collections",
+			"allocated_kb", "freed_kb", "live_kb", "live_objects", "peak_live_kb", "heap_kb",
+			"pauses", "total_pause_us", "longest_pause_us", "pause_histogram",
+		};
+		Value values[] = {
+			stat(stats->minor_collections), stat(stats->major_collections),
+			stat(stats->allocated_bytes / 1024), stat(stats->freed_bytes / 1024),
+			stat(stats->live_bytes / 1024), stat(stats->live_objects),
+			stat(stats->peak_live_bytes / 1024), stat(stats->heap_bytes / 1024),
+			stat(stats->pause_count), stat((size_t) (stats->total_pause_ms * 1000)),
+			stat((size_t) (stats->longest_pause_ms * 1000)), histogram,
+		};
+		static_assert(sizeof(names) / sizeof(names[0]) == sizeof(values) / sizeof(values[0]),
+					  "gc_stats fields are out of sync");
+		return object_of(names, values, sizeof(names) / sizeof(names[0]));
+	}
 	// Bridge
 	enum Builtin_Function {
 		BUILTIN_MATH_ABS,
 		BUILTIN_MATH_MOD,
 		BUILTIN_IO_PRINT,
 		BUILTIN_IO_PRINTLN,
+		BUILTIN_ARRAY_NEW,
+		BUILTIN_ARRAY_GET,
+		BUILTIN_ARRAY_SET,
+		BUILTIN_ARRAY_PUSH,
+		BUILTIN_ARRAY_LEN,
+		BUILTIN_DICT_NEW,
+		BUILTIN_DICT_GET,
+		BUILTIN_DICT_PUT,
+		BUILTIN_DICT_HAS,
+		BUILTIN_DICT_REMOVE,
+		BUILTIN_DICT_LEN,
+		BUILTIN_DICT_KEYS,
+		BUILTIN_DICT_VALUES,
+		BUILTIN_GC_STATS,
+	};
+	struct Arity {
+		int min;
+		int max;
 	};
-	size_t builtin_argument_counts[] = {
-		[BUILTIN_MATH_ABS] = 1,
-		[BUILTIN_MATH_MOD] = 2,
-		[BUILTIN_IO_PRINT] = 1,
-		[BUILTIN_IO_PRINTLN] = 1,		
+	const int VARIADIC = -1;
+	Arity builtin_arities[] = {
+		[BUILTIN_MATH_ABS] = { 1, 1 },
+		[BUILTIN_MATH_MOD] = { 2, 2 },
+		[BUILTIN_IO_PRINT] = { 0, VARIADIC },
+		[BUILTIN_IO_PRINTLN] = { 0, VARIADIC },
+		[BUILTIN_ARRAY_NEW] = { 0, VARIADIC },
+		[BUILTIN_ARRAY_GET] = { 2, 2 },
+		[BUILTIN_ARRAY_SET] = { 3, 3 },
+		[BUILTIN_ARRAY_PUSH] = { 2, 2 },
+		[BUILTIN_ARRAY_LEN] = { 1, 1 },
+		[BUILTIN_DICT_NEW] = { 0, VARIADIC },
+		[BUILTIN_DICT_GET] = { 2, 2 },
+		[BUILTIN_DICT_PUT] = { 3, 3 },
+		[BUILTIN_DICT_HAS] = { 2, 2 },
+		[BUILTIN_DICT_REMOVE] = { 2, 2 },
+		[BUILTIN_DICT_LEN] = { 1, 1 },
+		[BUILTIN_DICT_KEYS] = { 1, 1 },
+		[BUILTIN_DICT_VALUES] = { 1, 1 },
+		[BUILTIN_GC_STATS] = { 0, 0 },
 	};
-	Value(*builtin_funcptrs[])(Value *) = {
+	Value(*builtin_funcptrs[])(Value *, size_t) = {
 		[BUILTIN_MATH_ABS] = NAMEOF(abs),
 		[BUILTIN_MATH_MOD] = NAMEOF(mod),
 		[BUILTIN_IO_PRINT] = NAMEOF(print),
 		[BUILTIN_IO_PRINTLN] = NAMEOF(println),
+		[BUILTIN_ARRAY_NEW] = NAMEOF(array_new),
+		[BUILTIN_ARRAY_GET] = NAMEOF(array_get),
+		[BUILTIN_ARRAY_SET] = NAMEOF(array_set),
+		[BUILTIN_ARRAY_PUSH] = NAMEOF(array_push),
+		[BUILTIN_ARRAY_LEN] = NAMEOF(array_len),
+		[BUILTIN_DICT_NEW] = NAMEOF(dict_new),
+		[BUILTIN_DICT_GET] = NAMEOF(dict_get),
+		[BUILTIN_DICT_PUT] = NAMEOF(dict_put),
+		[BUILTIN_DICT_HAS] = NAMEOF(dict_has),
+		[BUILTIN_DICT_REMOVE] = NAMEOF(dict_remove),
+		[BUILTIN_DICT_LEN] = NAMEOF(dict_len),
+		[BUILTIN_DICT_KEYS] = NAMEOF(dict_keys),
+		[BUILTIN_DICT_VALUES] = NAMEOF(dict_values),
+		[BUILTIN_GC_STATS] = NAMEOF(gc_stats),
+	};
+	BC_Kind builtin_intrinsics[] = {
+		[BUILTIN_MATH_ABS] = BC_ABS,
+		[BUILTIN_MATH_MOD] = BC_MOD,
+		[BUILTIN_IO_PRINT] = BC_NOP,
+		[BUILTIN_IO_PRINTLN] = BC_NOP,
+		[BUILTIN_ARRAY_NEW] = BC_NOP,
+		[BUILTIN_ARRAY_GET] = BC_ARRAY_GET,
+		[BUILTIN_ARRAY_SET] = BC_ARRAY_SET,
+		[BUILTIN_ARRAY_PUSH] = BC_ARRAY_PUSH,
+		[BUILTIN_ARRAY_LEN] = BC_ARRAY_LEN,
+		[BUILTIN_DICT_NEW] = BC_NOP,
+		[BUILTIN_DICT_GET] = BC_NOP,
+		[BUILTIN_DICT_PUT] = BC_NOP,
+		[BUILTIN_DICT_HAS] = BC_NOP,
+		[BUILTIN_DICT_REMOVE] = BC_NOP,
+		[BUILTIN_DICT_LEN] = BC_NOP,
+		[BUILTIN_DICT_KEYS] = BC_NOP,
+		[BUILTIN_DICT_VALUES] = BC_NOP,
+		[BUILTIN_GC_STATS] = BC_NOP,
 	};
 	// FFI interface
 	bool symbol_comparator(Symbol a, Symbol b) { return a == b; }
@@ -95,6 +340,20 @@ namespace Builtins {
 		CASE("mod", BUILTIN_MATH_MOD);
 		CASE("print", BUILTIN_IO_PRINT);
 		CASE("println", BUILTIN_IO_PRINTLN);
+		CASE("array_new", BUILTIN_ARRAY_NEW);
+		CASE("array_get", BUILTIN_ARRAY_GET);
+		CASE("array_set", BUILTIN_ARRAY_SET);
+		CASE("array_push", BUILTIN_ARRAY_PUSH);
+		CASE("array_len", BUILTIN_ARRAY_LEN);
+		CASE("dict_new", BUILTIN_DICT_NEW);
+		CASE("dict_get", BUILTIN_DICT_GET);
+		CASE("dict_put", BUILTIN_DICT_PUT);
+		CASE("dict_has", BUILTIN_DICT_HAS);
+		CASE("dict_remove", BUILTIN_DICT_REMOVE);
+		CASE("dict_len", BUILTIN_DICT_LEN);
+		CASE("dict_keys", BUILTIN_DICT_KEYS);
+		CASE("dict_values", BUILTIN_DICT_VALUES);
+		CASE("gc_stats", BUILTIN_GC_STATS);
 		else fatal("Foreign function '%s' does not exist!", symbol);
 		assert(false); // @linter
 	}
@@ -108,8 +367,10 @@ namespace Builtins {
 		Builtin * ffi = (Builtin*) malloc(sizeof(Builtin));
 		Builtin_Function kind = lower_from_symbol(symbol);
 		ffi->name = symbol;
-		ffi->arg_count = builtin_argument_counts[kind];
+		ffi->min_args = builtin_arities[kind].min;
+		ffi->max_args = builtin_arities[kind].max;
 		ffi->funcptr = builtin_funcptrs[kind];
+		ffi->intrinsic = builtin_intrinsics[kind];
 		builtin_functions.add(symbol, ffi);
 		return ffi;
 	}
@@ -119,5 +380,6 @@ namespace Builtins {
 #undef PULL_THREE
 #undef PULL_TWO
 #undef PULL_ONE
+#undef ARG
 #undef NAMEOF
 #undef DEFINE
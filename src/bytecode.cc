@@ -8,12 +8,18 @@ enum BC_Kind {
 	BC_CREATE_BINDING,
 	BC_UPDATE_BINDING,
 	BC_RESOLVE_BINDING,
+	BC_LOAD_LOCAL,
+	BC_STORE_LOCAL,
+	BC_LOAD_FRAME,
+	BC_STORE_FRAME,
 	// arithmetic
 	BC_ADD,
 	BC_SUBTRACT,
 	BC_MULTIPLY,
 	BC_DIVIDE,
 	BC_NEGATE,
+	BC_MOD,
+	BC_ABS,
 	// comparison
 	BC_EQUAL,
 	BC_NOT_EQUAL,
@@ -21,9 +27,35 @@ enum BC_Kind {
 	BC_LESS_THAN,
 	BC_GREATER_THAN_OR_EQUAL_TO,
 	BC_LESS_THAN_OR_EQUAL_TO,
+	// Quickened forms of the above (see VM::run)
+	BC_ADD_INT,
+	BC_SUBTRACT_INT,
+	BC_MULTIPLY_INT,
+	BC_DIVIDE_INT,
+	BC_EQUAL_INT,
+	BC_NOT_EQUAL_INT,
+	BC_GREATER_THAN_INT,
+	BC_LESS_THAN_INT,
+	BC_GREATER_THAN_OR_EQUAL_TO_INT,
+	BC_LESS_THAN_OR_EQUAL_TO_INT,
+	// Forms for operands already known to be integers (see
+	// inference.cc), which don't check at all
+	BC_ADD_INT_UNCHECKED,
+	BC_SUBTRACT_INT_UNCHECKED,
+	BC_MULTIPLY_INT_UNCHECKED,
+	BC_DIVIDE_INT_UNCHECKED,
+	BC_EQUAL_INT_UNCHECKED,
+	BC_NOT_EQUAL_INT_UNCHECKED,
+	BC_GREATER_THAN_INT_UNCHECKED,
+	BC_LESS_THAN_INT_UNCHECKED,
+	BC_GREATER_THAN_OR_EQUAL_TO_INT_UNCHECKED,
+	BC_LESS_THAN_OR_EQUAL_TO_INT_UNCHECKED,
 	// functions
 	BC_CONSTRUCT_FUNCTION,
 	BC_POP_AND_CALL_FUNCTION,
+	BC_TAIL_CALL,
+	BC_CALL_KNOWN,
+	BC_TAIL_CALL_KNOWN,
 	BC_RETURN,
 	BC_THIS_FUNCTION,
 	// strings
@@ -42,14 +74,23 @@ enum BC_Kind {
 	BC_CONSTRUCT_CONSTRUCTOR,
 	BC_RESOLVE_FIELD,
 	BC_UPDATE_FIELD,
-	// bodies
-	BC_PUSH_BODY,
-	BC_BREAK_BODY,
+	// arrays
+	BC_ARRAY_GET,
+	BC_ARRAY_SET,
+	BC_ARRAY_PUSH,
+	BC_ARRAY_LEN,
 	// file units
 	BC_RUN_FILE_UNIT,
 	BC_EXPORT_SYMBOL,
 	// call flags
-	BC_GET_CALL_FLAG
+	BC_GET_CALL_FLAG,
+	// superinstructions (LOAD_CONST <symbol> fused with its consumer)
+	BC_RESOLVE_SYM,
+	BC_LET_SYM,
+	BC_SET_SYM,
+	BC_GET_FIELD_SYM,
+	BC_SET_FIELD_SYM,
+	BC_KIND_COUNT
 };
 
 static const char * BC_Kind_names[] = {
@@ -60,19 +101,48 @@ static const char * BC_Kind_names[] = {
 	"CREATE_BINDING",
 	"UPDATE_BINDING",
 	"RESOLVE_BINDING",
+	"LOAD_LOCAL",
+	"STORE_LOCAL",
+	"LOAD_FRAME",
+	"STORE_FRAME",
 	"ADD",
 	"SUBTRACT",
 	"MULTIPLY",
 	"DIVIDE",
 	"NEGATE",
+	"MOD",
+	"ABS",
 	"EQUAL",
 	"NOT_EQUAL",
 	"GREATER_THAN",
 	"LESS_THAN",
 	"GREATER_THAN_OR_EQUAL_TO",
 	"LESS_THAN_OR_EQUAL_TO",
+	"ADD_INT",
+	"SUBTRACT_INT",
+	"MULTIPLY_INT",
+	"DIVIDE_INT",
+	"EQUAL_INT",
+	"NOT_EQUAL_INT",
+	"GREATER_THAN_INT",
+	"LESS_THAN_INT",
+	"GREATER_THAN_OR_EQUAL_TO_INT",
+	"LESS_THAN_OR_EQUAL_TO_INT",
+	"ADD_INT_UNCHECKED",
+	"SUBTRACT_INT_UNCHECKED",
+	"MULTIPLY_INT_UNCHECKED",
+	"DIVIDE_INT_UNCHECKED",
+	"EQUAL_INT_UNCHECKED",
+	"NOT_EQUAL_INT_UNCHECKED",
+	"GREATER_THAN_INT_UNCHECKED",
+	"LESS_THAN_INT_UNCHECKED",
+	"GREATER_THAN_OR_EQUAL_TO_INT_UNCHECKED",
+	"LESS_THAN_OR_EQUAL_TO_INT_UNCHECKED",
 	"CONSTRUCT_FUNCTION",
 	"POP_AND_CALL_FUNCTION",
+	"TAIL_CALL",
+	"CALL_KNOWN",
+	"TAIL_CALL_KNOWN",
 	"RETURN",
 	"THIS_FUNCTION",
 	"SYMBOL_TO_STRING",
@@ -86,11 +156,18 @@ static const char * BC_Kind_names[] = {
 	"CONSTRUCT_CONSTRUCTOR",
 	"RESOLVE_FIELD",
 	"UPDATE_FIELD",
-	"PUSH_BODY",
-	"BREAK_BODY",
+	"ARRAY_GET",
+	"ARRAY_SET",
+	"ARRAY_PUSH",
+	"ARRAY_LEN",
 	"RUN_FILE_UNIT",
 	"EXPORT_SYMBOL",
 	"GET_CALL_FLAG",
+	"RESOLVE_SYM",
+	"LET_SYM",
+	"SET_SYM",
+	"GET_FIELD_SYM",
+	"SET_FIELD_SYM",
 };
 
 struct BC {
@@ -100,6 +177,19 @@ struct BC {
 		Value value;
 		int integer;
 		size_t block_reference;
+		Local_Address local;
+		// Where a known global was last found in its file's globals
+		struct {
+			Symbol symbol;
+			int index;
+		} global;
+		// The shape of the last object a field was looked up on, and
+		// where on it the field was
+		struct {
+			Symbol symbol;
+			Shape * shape;
+			int index;
+		} field;
 	} arg;
 	static BC create(BC_Kind kind, Assoc_Ptr assoc)
 	{
@@ -132,23 +222,76 @@ struct BC {
 		bc.assoc = assoc;
 		return bc;
 	}
+	static BC create_local(BC_Kind kind, Local_Address local, Assoc_Ptr assoc)
+	{
+		assert(local.is_local());
+		BC bc;
+		bc.kind = kind;
+		bc.arg.local = local;
+		bc.assoc = assoc;
+		return bc;
+	}
+	static BC create_global(BC_Kind kind, Symbol symbol, Assoc_Ptr assoc)
+	{
+		BC bc;
+		bc.kind = kind;
+		bc.arg.global.symbol = symbol;
+		bc.arg.global.index = -1;
+		bc.assoc = assoc;
+		return bc;
+	}
+	static BC create_field(BC_Kind kind, Symbol symbol, Assoc_Ptr assoc)
+	{
+		BC bc;
+		bc.kind = kind;
+		bc.arg.field.symbol = symbol;
+		bc.arg.field.shape = NULL;
+		bc.arg.field.index = -1;
+		bc.assoc = assoc;
+		return bc;
+	}
 	char * to_string()
 	{
 		String_Builder builder;
 		builder.append(BC_Kind_names[kind]);
 		builder.append(" ");
 		switch (kind) {
-		case BC_LOAD_CONST: {
+		case BC_LOAD_CONST:
+		case BC_GET_CALL_FLAG:
+		case BC_RESOLVE_SYM:
+		case BC_LET_SYM:
+		case BC_SET_SYM: {
 			char * s = arg.value.to_string();
 			defer { free(s); };
 			builder.append(s);
 		} break;
+		case BC_GET_FIELD_SYM:
+		case BC_SET_FIELD_SYM:
+			builder.append(arg.field.symbol);
+			break;
 		case BC_JUMP:
-		case BC_POP_JUMP: {
+		case BC_POP_JUMP:
+		case BC_ENTER_SCOPE: {
 			char * s = itoa(arg.integer);
 			defer { free(s); };
 			builder.append(s);
 		} break;
+		case BC_LOAD_LOCAL:
+		case BC_STORE_LOCAL: {
+			char buf[64];
+			snprintf(buf, sizeof(buf), "%d:%d", arg.local.depth, arg.local.slot);
+			builder.append(buf);
+		} break;
+		case BC_CALL_KNOWN:
+		case BC_TAIL_CALL_KNOWN:
+			builder.append(arg.global.symbol);
+			break;
+		case BC_LOAD_FRAME:
+		case BC_STORE_FRAME: {
+			char * s = itoa(arg.local.slot);
+			defer { free(s); };
+			builder.append(s);
+		} break;
 		default:
 			break;
 		}
@@ -161,13 +304,4 @@ struct BC {
 			}*/
 		return builder.final_string();
 	}
-	/* TODO(pixlark): Figure out what makes an instruction tail-call
-	 * safe, because this only covers the simplest of cases.
-	 */
-	static bool tail_call_safe(BC_Kind kind)
-	{
-		return
-			kind == BC_NOP ||
-			kind == BC_EXIT_SCOPE;
-	}
 };
@@ -1,29 +1,79 @@
+// A loop that `break` statements can currently jump out of
+struct Loop_Target {
+	List<int> exit_jumps;
+	int scope_depth;
+	// Whether the loop's value is what its function returns, making
+	// `break` expressions tail positions too
+	bool tail;
+};
+
 struct Compiler {
 	List<BC> bytecode;
 	Blocks * blocks;
 	size_t block_reference;
-	void init(Blocks * blocks)
+	size_t slot_count;
+	bool frame_environment;
+	// Whether this block is a lambda body (as opposed to a file)
+	bool is_function;
+	// Shared by every block in the file
+	File_Constants * constants;
+	// The file-level statement being compiled, if we're directly in it
+	Stmt * top_level_stmt;
+	// How many scopes deep we are within this block
+	int scope_depth;
+	List<Loop_Target> loops;
+	void init(Blocks * blocks, size_t slot_count = 0, bool frame_environment = true)
 	{
 		bytecode.alloc();
+		loops.alloc();
 		this->blocks = blocks;
+		this->slot_count = slot_count;
+		this->frame_environment = frame_environment;
+		is_function = false;
+		constants = NULL;
+		top_level_stmt = NULL;
+		scope_depth = 0;
 		block_reference = blocks->make_block();
 	}
 	void finalize()
 	{
+		// Every block ends in an explicit return, so the VM never
+		// has to check whether it has run off the end of a block
+		push(BC::create(BC_RETURN, -1));
 		BC * final_bc = (BC*) malloc(sizeof(BC) * bytecode.size);
 		for (int i = 0; i < bytecode.size; i++) {
 			final_bc[i] = bytecode[i];
 		}
-		blocks->finalize_block(block_reference, final_bc, bytecode.size);
+		size_t final_size = Peephole::optimize(final_bc, bytecode.size);
+		blocks->finalize_block(block_reference, final_bc, final_size,
+							   slot_count, frame_environment);
 	}
 	void destroy()
 	{
+		assert(loops.size == 0);
+		loops.dealloc();
 		bytecode.dealloc();
 	}
 	void push(BC bc)
 	{
 		bytecode.push(bc);
 	}	
+	void push_load_local(Local_Address address, Assoc_Ptr assoc)
+	{
+		if (address.kind == ADDRESS_FRAME) {
+			push(BC::create_local(BC_LOAD_FRAME, address, assoc));
+		} else {
+			push(BC::create_local(BC_LOAD_LOCAL, address, assoc));
+		}
+	}
+	void push_store_local(Local_Address address, Assoc_Ptr assoc)
+	{
+		if (address.kind == ADDRESS_FRAME) {
+			push(BC::create_local(BC_STORE_FRAME, address, assoc));
+		} else {
+			push(BC::create_local(BC_STORE_LOCAL, address, assoc));
+		}
+	}
 	void compile_operator(Operator op, Assoc_Ptr assoc)
 	{
 		switch (op) {
@@ -71,7 +121,87 @@ struct Compiler {
 			break;
 		}
 	}
-	void compile_expr(Expr * expr)
+	// Arithmetic and comparisons on operands known to be integers
+	// don't need checking (see inference.cc)
+	bool compile_integer_operator(Operator op, Assoc_Ptr assoc)
+	{
+		BC_Kind kind;
+		switch (op) {
+		case OP_ADD:
+			kind = BC_ADD_INT_UNCHECKED;
+			break;
+		case OP_SUBTRACT:
+			kind = BC_SUBTRACT_INT_UNCHECKED;
+			break;
+		case OP_MULTIPLY:
+			kind = BC_MULTIPLY_INT_UNCHECKED;
+			break;
+		case OP_DIVIDE:
+			kind = BC_DIVIDE_INT_UNCHECKED;
+			break;
+		case OP_EQUAL:
+			kind = BC_EQUAL_INT_UNCHECKED;
+			break;
+		case OP_NOT_EQUAL:
+			kind = BC_NOT_EQUAL_INT_UNCHECKED;
+			break;
+		case OP_LESS_THAN:
+			kind = BC_LESS_THAN_INT_UNCHECKED;
+			break;
+		case OP_GREATER_THAN:
+			kind = BC_GREATER_THAN_INT_UNCHECKED;
+			break;
+		case OP_LESS_THAN_OR_EQUAL_TO:
+			kind = BC_LESS_THAN_OR_EQUAL_TO_INT_UNCHECKED;
+			break;
+		case OP_GREATER_THAN_OR_EQUAL_TO:
+			kind = BC_GREATER_THAN_OR_EQUAL_TO_INT_UNCHECKED;
+			break;
+		default:
+			return false;
+		}
+		push(BC::create(kind, assoc));
+		return true;
+	}
+	// Calls straight through a constant global (see constants.cc)
+	// skip the type and arity checks, or become a single instruction
+	bool compile_known_call(Expr * expr, bool tail)
+	{
+		auto func = expr->funcall.func;
+		auto arg_count = expr->funcall.args.size;
+		Constant constant;
+		if (func->kind != EXPR_VARIABLE ||
+			func->variable.address.is_local() ||
+			!constants ||
+			!constants->lookup(func->variable.name, &constant)) {
+			return false;
+		}
+		if (constant.kind == CONSTANT_BUILTIN) {
+			auto intrinsic = constants->intrinsic_for(expr);
+			if (intrinsic == BC_NOP) {
+				return false;
+			}
+			push(BC::create(intrinsic, expr->assoc));
+			return true;
+		}
+		assert(constant.kind == CONSTANT_FUNCTION);
+		if (constant.parameter_count != arg_count) {
+			// Let the VM report it
+			return false;
+		}
+		BC_Kind kind = BC_CALL_KNOWN;
+		if (tail && TAIL_CALL_OPTIMIZATION) {
+			kind = BC_TAIL_CALL_KNOWN;
+		}
+		push(BC::create_global(kind, func->variable.name, expr->assoc));
+		return true;
+	}
+	/* `tail` is set when the value of `expr` is going to be returned
+	 * from the current function as-is. Calls in that position reuse
+	 * the caller's frame, so they're guaranteed to run in constant
+	 * stack space.
+	 */
+	void compile_expr(Expr * expr, bool tail = false)
 	{
 		switch (expr->kind) {
 		case EXPR_NOTHING:
@@ -86,6 +216,10 @@ struct Compiler {
 		case EXPR_BINARY:
 			compile_expr(expr->binary.left);
 			compile_expr(expr->binary.right);
+			if (expr->binary.integer_operands &&
+				compile_integer_operator(expr->binary.op, expr->assoc)) {
+				break;
+			}
 			compile_operator(expr->binary.op, expr->assoc);
 			break;
 		case EXPR_INTEGER:
@@ -101,8 +235,12 @@ struct Compiler {
 							expr->assoc));
 			break;
 		case EXPR_VARIABLE:
+			if (expr->variable.address.is_local()) {
+				push_load_local(expr->variable.address, expr->assoc);
+				break;
+			}
 			push(BC::create(BC_LOAD_CONST,
-							Value::raise(expr->variable),
+							Value::raise(expr->variable.name),
 							expr->assoc));
 			push(BC::create(BC_RESOLVE_BINDING,
 							expr->assoc));
@@ -110,32 +248,40 @@ struct Compiler {
 		case EXPR_SCOPE: {
 			auto body = expr->scope.body;
 			auto terminator = expr->scope.terminator;
-			push(BC::create(BC_ENTER_SCOPE, expr->assoc));
+			bool materialize = expr->scope.captured;
+			if (materialize) {
+				push(BC::create(BC_ENTER_SCOPE, expr->scope.slot_count, expr->assoc));
+				scope_depth++;
+			}
 			for (int i = 0; i < body.size; i++) {
 				compile_stmt(body[i]);
 			}
 			if (terminator) {
-				compile_expr(terminator);
+				compile_expr(terminator, tail);
 			} else {
 				push(BC::create(BC_LOAD_CONST,
 								Value::nothing(),
 								expr->assoc));
 			}
-			push(BC::create(BC_EXIT_SCOPE, expr->assoc));
+			if (materialize) {
+				push(BC::create(BC_EXIT_SCOPE, expr->assoc));
+				scope_depth--;
+			}
 		} break;
 		case EXPR_LAMBDA: {
 			auto params = expr->lambda.parameters;
-			for (int i = 0; i < params.size; i++) {
-				push(BC::create(BC_LOAD_CONST,
-								Value::raise(params[i]),
-								expr->assoc));
-			}
 			push(BC::create(BC_LOAD_CONST,
 							Value::raise(params.size),
 							expr->assoc));
 			Compiler compiler;
-			compiler.init(blocks);
-			compiler.compile_expr(expr->lambda.body);
+			compiler.init(blocks, expr->lambda.slot_count, expr->lambda.captured);
+			compiler.is_function = true;
+			compiler.constants = constants;
+			Int_Inference inference;
+			inference.init(constants);
+			inference.infer_function(expr);
+			inference.destroy();
+			compiler.compile_expr(expr->lambda.body, true);
 			compiler.finalize();
 			compiler.destroy();
 			
@@ -149,12 +295,22 @@ struct Compiler {
 			for (int i = args.size - 1; i >= 0; i--) {
 				compile_expr(args[i]);
 			}
+			if (compile_known_call(expr, tail)) {
+				break;
+			}
 			push(BC::create(BC_LOAD_CONST,
 							Value::raise(args.size),
 							expr->assoc));
 			compile_expr(expr->funcall.func);
-			push(BC::create(BC_POP_AND_CALL_FUNCTION,
-							expr->assoc));
+			if (tail && TAIL_CALL_OPTIMIZATION) {
+				push(BC::create(BC_TAIL_CALL, expr->assoc));
+				// Only reached if the callee turned out to be a builtin
+				// or constructor, which don't replace our frame
+				push(BC::create(BC_RETURN, expr->assoc));
+			} else {
+				push(BC::create(BC_POP_AND_CALL_FUNCTION,
+								expr->assoc));
+			}
 		} break;
 		case EXPR_IF: {
 			List<int> end_jumps;
@@ -167,13 +323,13 @@ struct Compiler {
 				push(BC::create(BC_NOT, _if.conditions[i]->assoc));
 				push(BC::create(BC_POP_JUMP, _if.conditions[i]->assoc));
 				int skip_pos = bytecode.size - 1;
-				compile_expr(_if.expressions[i]);
+				compile_expr(_if.expressions[i], tail);
 				push(BC::create(BC_JUMP, _if.conditions[i]->assoc));
 				end_jumps.push(bytecode.size - 1);
 				bytecode[skip_pos].arg.integer = bytecode.size;
 			}
 			if (_if.else_expr) {
-				compile_expr(_if.else_expr);
+				compile_expr(_if.else_expr, tail);
 			} else {
 				push(BC::create(BC_LOAD_CONST,
 								Value::nothing(),
@@ -205,12 +361,10 @@ struct Compiler {
 				if (args[0]->kind != EXPR_VARIABLE) {
 					fatal_assoc(args[0]->assoc, "@builtin directive expects constant symbol");
 				}
-				auto builtin_symbol = args[0]->variable;
+				auto builtin_symbol = args[0]->variable.name;
 				// Builtin binding
 				auto builtin = Builtins::get_builtin(builtin_symbol);
-				Value value = Value::create(TYPE_BUILTIN);
-				value.builtin = builtin;
-				push(BC::create(BC_LOAD_CONST, value, expr->assoc));
+				push(BC::create(BC_LOAD_CONST, Value::raise(builtin), expr->assoc));
 			} else if (name == Intern::intern("struct")) {
 				// @struct directive
 				auto args = expr->directive.arguments;
@@ -218,7 +372,7 @@ struct Compiler {
 					if (args[i]->kind != EXPR_VARIABLE) {
 						fatal_assoc(args[i]->assoc, "@struct directive expects constant symbols");
 					}
-					push(BC::create(BC_LOAD_CONST, Value::raise(args[i]->variable), args[i]->assoc));
+					push(BC::create(BC_LOAD_CONST, Value::raise(args[i]->variable.name), args[i]->assoc));
 				}
 				push(BC::create(BC_LOAD_CONST, Value::raise(args.size), expr->assoc));
 				push(BC::create(BC_CONSTRUCT_CONSTRUCTOR, expr->assoc));
@@ -232,18 +386,26 @@ struct Compiler {
 					auto filename = args[0]->string;
 					path = Files::path_for_file(filename);
 				} else if (args[0]->kind == EXPR_VARIABLE) {
-					auto filename = args[0]->variable;
+					auto filename = args[0]->variable.name;
 					path = Files::stdlib_file(filename);
 				} else {
 					fatal_assoc(args[0]->assoc, "@import directive expects constant string or symbol");
 				}
 				defer { free((void*) path); };
 				// Compile file into our global Blocks
+				List<Symbol> imported;
+				imported.alloc();
+				defer { imported.dealloc(); };
 				size_t block_reference = blocks->upcoming_block();
-				auto source = load_and_compile_file(blocks, path);
+				auto source = load_and_compile_file(blocks, path, &imported);
 				if (!source) {
 					fatal_assoc(args[0]->assoc, "Source file '%s' does not exist", path);
 				}
+				// Only an import that's sure to have run can tell us
+				// anything about later code
+				if (is_top_level_expr(expr)) {
+					constants->learn_import(&imported);
+				}
 				// @Warning: Implicit cast from size_t->int
 				push(BC::create(BC_LOAD_CONST, Value::raise(block_reference), expr->assoc));
 				push(BC::create(BC_RUN_FILE_UNIT, expr->assoc));
@@ -252,8 +414,15 @@ struct Compiler {
 					if (args[i]->kind != EXPR_VARIABLE) {
 						fatal_assoc(args[i]->assoc, "@export directive expects constant symbols");
 					}
-					push(BC::create(BC_LOAD_CONST, Value::raise(args[i]->variable), args[i]->assoc));
+					push(BC::create(BC_LOAD_CONST, Value::raise(args[i]->variable.name), args[i]->assoc));
 					push(BC::create(BC_EXPORT_SYMBOL, args[i]->assoc));
+					if (is_top_level_expr(expr)) {
+						constants->exports.push(args[i]->variable.name);
+					} else {
+						// Might or might not happen, so nobody else
+						// can rely on the name either
+						Constants::record_export(args[i]->variable.name, Constant::unknown());
+					}
 				}
 			} else {
 				// No such directive
@@ -269,8 +438,11 @@ struct Compiler {
 			push(BC::create(BC_RESOLVE_FIELD, expr->assoc));
 		} break;
 		case EXPR_LOOP: {
-            int push_body_pos = bytecode.size;
-            push(BC::create(BC_PUSH_BODY, expr->assoc));
+			Loop_Target target;
+			target.exit_jumps.alloc();
+			target.scope_depth = scope_depth;
+			target.tail = tail;
+			loops.push(target);
 
 			// Create a dummy value to be popped by first iteration
 			push(BC::create(BC_LOAD_CONST, Value::nothing(), expr->assoc));
@@ -286,30 +458,73 @@ struct Compiler {
 
             int exit_pos = bytecode.size;
             push(BC::create(BC_NOP, expr->assoc));
-            bytecode[push_body_pos].arg.integer = exit_pos;
+
+			target = loops.pop();
+			for (int i = 0; i < target.exit_jumps.size; i++) {
+				bytecode[target.exit_jumps[i]].arg.integer = exit_pos;
+			}
+			target.exit_jumps.dealloc();
 		} break;
 		case EXPR_ON: {
+			// If the flag isn't set, its (nothing) value is the
+			// result of the whole expression
 			push(BC::create(BC_GET_CALL_FLAG, Value::raise(expr->on.to_bind), expr->assoc));
+			push(BC::create(BC_DUPLICATE, expr->assoc));
 			push(BC::create(BC_NOT, expr->assoc));
 			
 			int jump_pos = bytecode.size;
 			push(BC::create(BC_POP_JUMP, expr->assoc));
 			
-			push(BC::create(BC_LOAD_CONST, Value::raise(expr->on.to_bind), expr->assoc));
-			push(BC::create(BC_CREATE_BINDING, expr->assoc));
-			compile_expr(expr->on.body);
+			if (expr->on.captured) {
+				push(BC::create(BC_ENTER_SCOPE, 1, expr->assoc));
+				scope_depth++;
+			}
+			push_store_local(expr->on.address, expr->assoc);
+			compile_expr(expr->on.body, tail);
+			if (expr->on.captured) {
+				push(BC::create(BC_EXIT_SCOPE, expr->assoc));
+				scope_depth--;
+			}
+			int end_jump_pos = bytecode.size;
+			push(BC::create(BC_JUMP, expr->assoc));
 			
 			int exit_pos = bytecode.size;
 			push(BC::create(BC_NOP, expr->assoc));
 			bytecode[jump_pos].arg.integer = exit_pos;
+			bytecode[end_jump_pos].arg.integer = exit_pos;
 		} break;
 		}
 	}
+	// Statements at the top level of a file run exactly once, in order
+	void compile_top_level_stmt(Stmt * stmt)
+	{
+		Int_Inference inference;
+		inference.init(constants);
+		inference.infer_top_level(stmt);
+		inference.destroy();
+		top_level_stmt = stmt;
+		compile_stmt(stmt);
+		top_level_stmt = NULL;
+	}
+	bool is_top_level_expr(Expr * expr)
+	{
+		return
+			top_level_stmt &&
+			top_level_stmt->kind == STMT_EXPR &&
+			top_level_stmt->expr == expr;
+	}
 	void compile_stmt(Stmt * stmt)
 	{
 		switch (stmt->kind) {
 		case STMT_LET:
+			if (!stmt->let.address.is_local() && constants) {
+				constants->learn_let(stmt->let.left, stmt->let.right);
+			}
 			compile_expr(stmt->let.right);
+			if (stmt->let.address.is_local()) {
+				push_store_local(stmt->let.address, stmt->assoc);
+				break;
+			}
 			push(BC::create(BC_LOAD_CONST,
 							Value::raise(stmt->let.left),
 							stmt->assoc));
@@ -323,8 +538,12 @@ struct Compiler {
 			switch (left->kind) {
 			case EXPR_VARIABLE:
 				// Simple variable binding
+				if (left->variable.address.is_local()) {
+					push_store_local(left->variable.address, stmt->assoc);
+					break;
+				}
 				push(BC::create(BC_LOAD_CONST,
-								Value::raise(left->variable),
+								Value::raise(left->variable.name),
 								stmt->assoc));
 				push(BC::create(BC_UPDATE_BINDING,
 								stmt->assoc));
@@ -343,17 +562,26 @@ struct Compiler {
 			}
 		} break;
 		case STMT_RETURN:
-			compile_expr(stmt->_return.expr);
+			compile_expr(stmt->_return.expr, is_function);
 			push(BC::create(BC_RETURN, stmt->assoc));
 			break;
 		case STMT_EXPR:
 			compile_expr(stmt->expr);
 			push(BC::create(BC_POP_AND_DISCARD, stmt->assoc));
 			break;
-		case STMT_BREAK:
-			compile_expr(stmt->expr);
-			push(BC::create(BC_BREAK_BODY, stmt->assoc));
-			break;
+		case STMT_BREAK: {
+			if (loops.size == 0) {
+				fatal_assoc(stmt->assoc, "Nothing to break out of");
+			}
+			compile_expr(stmt->_break, loops[loops.size - 1].tail);
+			// Leave any scopes we're inside of within the loop body
+			auto target = &loops[loops.size - 1];
+			for (int i = target->scope_depth; i < scope_depth; i++) {
+				push(BC::create(BC_EXIT_SCOPE, stmt->assoc));
+			}
+			push(BC::create(BC_JUMP, stmt->assoc));
+			target->exit_jumps.push(bytecode.size - 1);
+		} break;
 		}
 	}
 };
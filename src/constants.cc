@@ -0,0 +1,223 @@
+/* CONSTANTS
+ *
+ * Works out which top-level bindings the compiler can know the value
+ * of ahead of time, so that calls through them can skip the usual
+ * lookup and dispatch:
+ *
+ *  - Calls through `let f = lambda ...` compile to CALL_KNOWN, which
+ *    fetches f straight from its file's globals and doesn't need to
+ *    check its type or arity.
+ *  - Calls through `let mod = @builtin[mod]` compile to the builtin's
+ *    intrinsic instruction, if it has one. This also works for
+ *    builtins exported from another file, like stdlib/math.bdg.
+ *
+ * A binding only qualifies if it's bound by exactly one top-level
+ * `let` in its file, and never `set`. What we know is only used by
+ * code that comes after the `let` (or the `@import`) in the file,
+ * which can't run before the binding exists.
+ */
+
+enum Constant_Kind {
+	CONSTANT_UNKNOWN,
+	CONSTANT_BUILTIN,
+	CONSTANT_FUNCTION,
+};
+
+struct Constant {
+	Constant_Kind kind;
+	union {
+		Builtin * builtin;
+		size_t parameter_count;
+	};
+	static Constant unknown()
+	{
+		Constant constant;
+		constant.kind = CONSTANT_UNKNOWN;
+		return constant;
+	}
+	bool same_as(Constant other)
+	{
+		return
+			kind == CONSTANT_BUILTIN &&
+			other.kind == CONSTANT_BUILTIN &&
+			builtin == other.builtin;
+	}
+};
+
+bool contains_symbol(List<Symbol> * list, Symbol symbol)
+{
+	for (int i = 0; i < list->size; i++) {
+		if ((*list)[i] == symbol) {
+			return true;
+		}
+	}
+	return false;
+}
+
+namespace Constants {
+	/* Exports from every file all land in the same scope, and the
+	 * first one to get there wins. Since the whole program is
+	 * compiled before any of it runs, we can't tell which one that
+	 * will be, so a name exported inconsistently by two files is
+	 * never relied upon. If we'd already relied on it by the time
+	 * the second export turned up, the program has to be compiled
+	 * again -- `conflicting` survives this, so it only happens once.
+	 */
+	Map<Symbol, Constant> exported;
+	List<Symbol> conflicting;
+	List<Symbol> relied_upon;
+	bool invalidated;
+	bool symbol_comparator(Symbol a, Symbol b) { return a == b; }
+	void init()
+	{
+		exported.alloc(symbol_comparator);
+		conflicting.alloc();
+		relied_upon.alloc();
+		invalidated = false;
+	}
+	void destroy()
+	{
+		exported.dealloc();
+		conflicting.dealloc();
+		relied_upon.dealloc();
+	}
+	// Forget everything but the conflicts, before compiling again
+	void reset()
+	{
+		exported.dealloc();
+		exported.alloc(symbol_comparator);
+		relied_upon.size = 0;
+		invalidated = false;
+	}
+	void record_export(Symbol symbol, Constant constant)
+	{
+		if (contains_symbol(&conflicting, symbol)) {
+			return;
+		}
+		if (!exported.bound(symbol)) {
+			exported.add(symbol, constant);
+			return;
+		}
+		if (exported.lookup(symbol).same_as(constant)) {
+			return;
+		}
+		conflicting.push(symbol);
+		if (contains_symbol(&relied_upon, symbol)) {
+			invalidated = true;
+		}
+	}
+	bool lookup_export(Symbol symbol, Constant * constant)
+	{
+		if (!exported.bound(symbol) || contains_symbol(&conflicting, symbol)) {
+			return false;
+		}
+		*constant = exported.lookup(symbol);
+		if (constant->kind == CONSTANT_UNKNOWN) {
+			return false;
+		}
+		relied_upon.push(symbol);
+		return true;
+	}
+}
+
+// What the compiler knows about one file's globals so far
+struct File_Constants {
+	Resolver * resolver;
+	// CONSTANT_UNKNOWN for anything we don't know
+	Symbol_Table<Constant> known;
+	List<Symbol> exports;
+	void init(Resolver * resolver)
+	{
+		this->resolver = resolver;
+		known.alloc(Constant::unknown());
+		exports.alloc();
+	}
+	void destroy()
+	{
+		known.dealloc();
+		exports.dealloc();
+	}
+	int let_count(Symbol symbol)
+	{
+		return resolver->global_lets.get(symbol);
+	}
+	bool is_set(Symbol symbol)
+	{
+		return resolver->global_sets.get(symbol);
+	}
+	// Called as we reach a top-level `let`, before compiling the
+	// right-hand side (so that a function can know itself)
+	void learn_let(Symbol symbol, Expr * right)
+	{
+		if (let_count(symbol) != 1 || is_set(symbol)) {
+			return;
+		}
+		Constant constant;
+		if (right->kind == EXPR_LAMBDA) {
+			constant.kind = CONSTANT_FUNCTION;
+			constant.parameter_count = right->lambda.parameters.size;
+		} else if (right->kind == EXPR_DIRECTIVE &&
+				   right->directive.name == Intern::intern("builtin") &&
+				   right->directive.arguments.size == 1 &&
+				   right->directive.arguments[0]->kind == EXPR_VARIABLE) {
+			constant.kind = CONSTANT_BUILTIN;
+			constant.builtin = Builtins::get_builtin(right->directive.arguments[0]->variable.name);
+		} else {
+			return;
+		}
+		known.set(symbol, constant);
+	}
+	// Called after a top-level `@import` with everything the imported
+	// file exports
+	void learn_import(List<Symbol> * imported)
+	{
+		for (int i = 0; i < imported->size; i++) {
+			auto symbol = (*imported)[i];
+			// Our own globals are found before anything imported
+			if (let_count(symbol) != 0 || is_set(symbol) ||
+				known.get(symbol).kind != CONSTANT_UNKNOWN) {
+				continue;
+			}
+			Constant constant;
+			if (Constants::lookup_export(symbol, &constant)) {
+				known.set(symbol, constant);
+			}
+		}
+	}
+	bool lookup(Symbol symbol, Constant * constant)
+	{
+		*constant = known.get(symbol);
+		return constant->kind != CONSTANT_UNKNOWN;
+	}
+	// The instruction a call can be replaced by, or BC_NOP
+	BC_Kind intrinsic_for(Expr * funcall)
+	{
+		auto func = funcall->funcall.func;
+		auto arg_count = funcall->funcall.args.size;
+		Constant constant;
+		if (func->kind != EXPR_VARIABLE ||
+			func->variable.address.is_local() ||
+			!lookup(func->variable.name, &constant) ||
+			constant.kind != CONSTANT_BUILTIN) {
+			return BC_NOP;
+		}
+		auto builtin = constant.builtin;
+		if (builtin->min_args != arg_count || builtin->max_args != arg_count) {
+			return BC_NOP;
+		}
+		return builtin->intrinsic;
+	}
+	// Called once the whole file has been compiled
+	void record_exports()
+	{
+		for (int i = 0; i < exports.size; i++) {
+			// Functions are only known within their own file, since
+			// CALL_KNOWN looks them up in the caller's globals
+			Constant constant;
+			if (!lookup(exports[i], &constant) || constant.kind != CONSTANT_BUILTIN) {
+				constant = Constant::unknown();
+			}
+			Constants::record_export(exports[i], constant);
+		}
+	}
+};
@@ -1,36 +1,153 @@
+/* Environments come in two flavours:
+ *
+ *  - Named environments (the global scope of a file, the export
+ *    scope) hold a list of names (as symbol IDs) and values that grow
+ *    as bindings are created, and are searched by symbol. Once one
+ *    has more than INDEX_AFTER names, it also keeps a Name_Index, so
+ *    that big files don't have to search through all of their
+ *    globals.
+ *  - Slotted environments (lambda frames, scopes) have a fixed number
+ *    of slots worked out by the Resolver, stored inline after the
+ *    Environment itself, and are only ever accessed by index.
+ */
+// Where each name is in a named environment. A hash table from
+// symbol ID to position with open addressing, kept at most half full,
+// so it's sized by the environment's own names rather than by every
+// symbol there is.
+struct Name_Index {
+	struct Entry {
+		Symbol_ID id;
+		// One more than the position in `names`, or 0 if the entry
+		// is free
+		int position;
+	};
+	size_t capacity;
+	Entry entries[];
+	static Name_Index * alloc(size_t capacity)
+	{
+		auto index = (Name_Index*) GC::alloc(sizeof(Name_Index) + sizeof(Entry) * capacity);
+		index->capacity = capacity;
+		memset(index->entries, 0, sizeof(Entry) * capacity);
+		return index;
+	}
+	// The entry for `id`, or the free one it would go in
+	Entry * find(Symbol_ID id)
+	{
+		size_t mask = capacity - 1;
+		for (size_t i = hash_word(id) & mask;; i = (i + 1) & mask) {
+			auto entry = &entries[i];
+			if (!entry->position || entry->id == id) {
+				return entry;
+			}
+		}
+	}
+	void insert(Symbol_ID id, int position)
+	{
+		auto entry = find(id);
+		entry->id = id;
+		entry->position = position + 1;
+	}
+};
+
 struct Environment {
-	GC_List<Symbol> names;
+	static const size_t INDEX_AFTER = 16;
+
+	GC_List<Symbol_ID> names;
 	GC_List<Value> values;
+	// NULL until there are more than INDEX_AFTER names
+	Name_Index * index;
 
 	Environment * next_env;
-	
-	static Environment * alloc()
+
+	bool named;
+	size_t slot_count;
+	Value slots[];
+
+	static Environment * alloc_slots(size_t slot_count)
+	{
+		Environment * env = (Environment*) GC::alloc(sizeof(Environment) +
+													 sizeof(Value) * slot_count);
+		env->names.size = 0;
+		env->values.size = 0;
+		env->index = NULL;
+		env->next_env = NULL;
+		env->named = false;
+		env->slot_count = slot_count;
+		for (int i = 0; i < slot_count; i++) {
+			env->slots[i] = Value::unset();
+		}
+		return env;
+	}
+	// Named environments can have slots too; a file's globals live
+	// alongside the slots of any scopes at its top level
+	static Environment * alloc(size_t slot_count = 0)
 	{
-		Environment * env = (Environment*) GC::alloc(sizeof(Environment));
+		Environment * env = alloc_slots(slot_count);
 		env->names.alloc();
 		env->values.alloc();
-		env->next_env = NULL;
+		env->named = true;
+		GC::write_barrier(env);
 		return env;
 	}
 	void gc_mark()
 	{
-		names.gc_mark();
-		values.gc_mark();
-		for (int i = 0; i < values.size; i++) {
-			values[i].gc_mark();
+		if (named) {
+			names.gc_mark();
+			values.gc_mark_elements();
+			// Never goes back to NULL once it's been made
+			if (__atomic_load_n(&index, __ATOMIC_RELAXED)) {
+				GC::trace_leaf(&index);
+			}
+		}
+		for (int i = 0; i < slot_count; i++) {
+			slots[i].gc_mark();
 		}
 		if (next_env) {
-			GC::mark_opaque(next_env);
-			next_env->gc_mark();
+			GC::trace(&next_env);
 		}
 	}
-	bool is_bound(Symbol symbol, bool recurse=true)
+	Environment * ancestor(int depth)
 	{
-		assert(names.size == values.size);
+		Environment * env = this;
+		for (int i = 0; i < depth; i++) {
+			env = env->next_env;
+		}
+		return env;
+	}
+	// Index of `symbol` among this environment's own names, or -1
+	int index_of(Symbol symbol)
+	{
+		auto id = Intern::id_of(symbol);
+		if (index) {
+			return index->find(id)->position - 1;
+		}
 		for (int i = 0; i < names.size; i++) {
-			if (symbol == names[i]) {
-				return true;
+			if (id == names[i]) {
+				return i;
+			}
+		}
+		return -1;
+	}
+	// Adds the newest name to the index, first making the index (or a
+	// bigger one, from all of `names`) if it's time to
+	void update_index()
+	{
+		if (!index || names.size * 2 > index->capacity) {
+			size_t capacity = index ? index->capacity * 2 : INDEX_AFTER * 4;
+			auto grown = Name_Index::alloc(capacity);
+			for (int i = 0; i < names.size; i++) {
+				grown->insert(names[i], i);
 			}
+			__atomic_store_n(&index, grown, __ATOMIC_RELEASE);
+			return;
+		}
+		index->insert(names[names.size - 1], names.size - 1);
+	}
+	bool is_bound(Symbol symbol, bool recurse=true)
+	{
+		assert(names.size == values.size);
+		if (index_of(symbol) >= 0) {
+			return true;
 		}
 		if (recurse && next_env) {
 			return next_env->is_bound(symbol);
@@ -39,24 +156,29 @@ struct Environment {
 	}
 	bool create_binding(Symbol symbol, Value value)
 	{
+		assert(named);
 		assert(names.size == values.size);
 		// TODO(pixlark): Do we want to be able to shadow closed
 		// variables? Probably...
 		if (is_bound(symbol, false)) {
 			return false;
 		}
-		names.push(symbol);
+		names.push(Intern::id_of(symbol));
 		values.push(value);
+		if (index || names.size > INDEX_AFTER) {
+			update_index();
+		}
+		GC::write_barrier(this);
 		return true;
 	}
 	bool update_binding(Symbol symbol, Value value)
 	{
 		assert(names.size == values.size);
-		for (int i = 0; i < names.size; i++) {
-			if (symbol == names[i]) {
-				values[i] = value;
-				return true;
-			}
+		int i = index_of(symbol);
+		if (i >= 0) {
+			values[i].store(value);
+			GC::write_barrier(this);
+			return true;
 		}
 		if (next_env) {
 			return next_env->update_binding(symbol, value);
@@ -66,11 +188,10 @@ struct Environment {
 	bool resolve_binding(Symbol symbol, Value * value)
 	{
 		assert(names.size == values.size);
-		for (int i = 0; i < names.size; i++) {
-			if (symbol == names[i]) {
-				*value = values[i];
-				return true;
-			}
+		int i = index_of(symbol);
+		if (i >= 0) {
+			*value = values[i];
+			return true;
 		}
 		if (next_env) {
 			return next_env->resolve_binding(symbol, value);
@@ -4,9 +4,34 @@ struct GC_List : List<T> {
 	{
 		List<T>::alloc(GC::allocator);
 	}
+	// Marking threads can be reading the list while it's pushed to
+	// (see MARKING THREADS in gc.cc), so a new element, and a new
+	// array if the list had to grow, go in before the size that covers
+	// them
+	void push(T value)
+	{
+		if (this->size == this->capacity) {
+			T * arr = (T*) this->allocator.__malloc(sizeof(T) * this->capacity * 2);
+			memcpy(arr, this->arr, sizeof(T) * this->size);
+			__atomic_store_n(&this->arr, arr, __ATOMIC_RELEASE);
+			this->capacity *= 2;
+		}
+		this->arr[this->size] = value;
+		__atomic_store_n(&this->size, this->size + 1, __ATOMIC_RELEASE);
+	}
 	void gc_mark()
 	{
-		GC::mark_opaque(List<T>::get_raw());
+		GC::trace_leaf(&this->arr);
+	}
+	// Also marks each element
+	void gc_mark_elements()
+	{
+		size_t size = __atomic_load_n(&this->size, __ATOMIC_ACQUIRE);
+		gc_mark();
+		T * arr = __atomic_load_n(&this->arr, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < size; i++) {
+			arr[i].gc_mark();
+		}
 	}
 };
 
@@ -18,7 +43,7 @@ struct GC_Map : Map<K, V> {
 	}
 	void gc_mark()
 	{
-		GC::mark_opaque(Map<K, V>::get_keys()->get_raw());
-		GC::mark_opaque(Map<K, V>::get_values()->get_raw());
+		GC::trace_leaf(&Map<K, V>::get_keys()->arr);
+		GC::trace_leaf(&Map<K, V>::get_values()->arr);
 	}
 };
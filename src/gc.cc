@@ -1,97 +1,1452 @@
 #define COLLECTION true
-#define SHOW_TOTAL_ALLOCATIONS false
-#define SHOW_COLLECTIONS false
+
+/* GC HEAP
+ *
+ * The heap has two generations. New objects are bump-allocated in the
+ * nursery; a minor collection copies whatever is still reachable out
+ * of the nursery into the old generation and then reuses the nursery
+ * from the start, so short-lived garbage costs nothing to collect. A
+ * major collection does a minor collection and then marks through the
+ * whole old generation, freeing what it doesn't reach.
+ *
+ * Old objects live in pages of fixed-size cells, one list of pages
+ * per size class. Pages are PAGE_SIZE bytes and aligned to PAGE_SIZE,
+ * so the page an object belongs to is found by masking its address;
+ * the page header keeps bitmaps with one bit per cell. Cells are
+ * 16-byte aligned. Anything too big for the largest size class gets a
+ * "large page" of its own, which looks like a page with a single
+ * cell, and is always allocated straight into the old generation.
+ *
+ * Nursery pages are PAGE_SIZE-aligned too, so telling young objects
+ * from old is a matter of looking at the page header. Each young
+ * object has a small header of its own holding its size and, once
+ * it's been copied, where it went.
+ *
+ * Each page's `live` bitmap says which cells are in use: everything
+ * the last major collection marked, plus everything allocated since.
+ * Sweeping is lazy: after a major collection, allocation walks each
+ * size class's pages in turn and hands out the cells `live` says are
+ * free, a bitmap word at a time. Marking has a bitmap of its own, so
+ * allocation can carry on as normal while it's in progress (see
+ * COLLECTING below). Pages left with nothing live are given back.
+ *
+ * A minor collection only traces from the roots and from old objects
+ * that might point into the nursery. Code that stores a value into
+ * an Environment or Object calls write_barrier() on it, which
+ * remembers it (once) until the next collection.
+ *
+ * Tracing works on pointer fields rather than pointers, since copying
+ * an object means updating everything that points to it. The first
+ * time trace(&ptr) reaches an object in a collection it goes on a
+ * list, and the object's own gc_mark() is called once it comes off
+ * again.
+ */
 
 namespace GC {
-	List<void*> allocations;
+	const size_t PAGE_SIZE = 16 * 1024;
+	const size_t CELL_ALIGNMENT = 16;
+	const int SMALLEST_CELL_SHIFT = 4;
+	const int SIZE_CLASS_COUNT = 7; // 16 bytes to 1KiB
+	const size_t LARGEST_CELL = 1 << (SMALLEST_CELL_SHIFT + SIZE_CLASS_COUNT - 1);
+	const size_t MARK_WORDS = PAGE_SIZE / (1 << SMALLEST_CELL_SHIFT) / 64;
+	// Nursery pages kept between collections; more are added if it
+	// fills up before the VM reaches a safepoint
+	const size_t NURSERY_PAGES = 16;
+	// A major collection starts once the old generation reaches
+	// DEFAULT_GROWTH times what was live after the last one, or
+	// DEFAULT_MIN_HEAP, whichever is bigger. $BADGE_GC_GROWTH and
+	// $BADGE_GC_MIN_HEAP (or --gc-growth and --gc-min-heap) override
+	// them.
+	const double DEFAULT_GROWTH = 2.0;
+	const size_t DEFAULT_MIN_HEAP = 4 * 1024 * 1024;
+	// While marking is in progress, the program gets a pause every
+	// SLICE_INTERVAL bytes of allocation, not just when the nursery
+	// fills up. $BADGE_GC_SLICE overrides the budget.
+	const size_t SLICE_INTERVAL = 64 * 1024;
+	#if RELEASE
+	const size_t DEFAULT_SLICE_BUDGET = 4096;
+	#else
+	const size_t DEFAULT_SLICE_BUDGET = 4;
+	#endif
+
+	enum Page_Kind {
+		PAGE_SMALL,
+		PAGE_LARGE,
+		PAGE_NURSERY,
+	};
+
+	struct Page {
+		// Next page in the same size class, or the next large page
+		Page * next;
+		Page_Kind kind;
+		int cell_shift;
+		size_t cell_size;
+		size_t cell_count;
+		uint8_t * cells;
+		uint64_t live[MARK_WORDS];
+		uint64_t marks[MARK_WORDS];
+		// Cells on the remembered set
+		uint64_t remembered[MARK_WORDS];
+		// Set on pages being emptied by compaction (see COMPACTING
+		// below)
+		bool evacuating;
+		// Including the header
+		size_t bytes;
+		static size_t header_size()
+		{
+			return (sizeof(Page) + CELL_ALIGNMENT - 1) & ~(CELL_ALIGNMENT - 1);
+		}
+		static Page * of(void * ptr)
+		{
+			return (Page*) (((uintptr_t) ptr) & ~((uintptr_t) PAGE_SIZE - 1));
+		}
+		size_t cell_index(void * ptr)
+		{
+			return ((uint8_t*) ptr - cells) >> cell_shift;
+		}
+		void * cell(size_t index)
+		{
+			return cells + (index << cell_shift);
+		}
+		static bool test(uint64_t * bits, size_t index)
+		{
+			return (bits[index / 64] >> (index % 64)) & 1;
+		}
+		static void set(uint64_t * bits, size_t index, bool value)
+		{
+			uint64_t bit = ((uint64_t) 1) << (index % 64);
+			bits[index / 64] = value ? (bits[index / 64] | bit) : (bits[index / 64] & ~bit);
+		}
+		bool is_marked(size_t index)
+		{
+			return test(marks, index);
+		}
+		void mark(size_t index)
+		{
+			set(marks, index, true);
+		}
+		size_t mark_word_count()
+		{
+			return (cell_count + 63) / 64;
+		}
+		// The cells in word `word` of the bitmap that are free
+		uint64_t free_cells(size_t word)
+		{
+			uint64_t free = ~live[word];
+			size_t remaining = cell_count - word * 64;
+			if (remaining < 64) {
+				free &= (((uint64_t) 1) << remaining) - 1;
+			}
+			return free;
+		}
+		void clear_marks()
+		{
+			memset(marks, 0, sizeof(marks));
+		}
+		// Once marking is done, whatever wasn't marked is free
+		void sweep()
+		{
+			memcpy(live, marks, sizeof(live));
+		}
+		size_t live_count()
+		{
+			size_t count = 0;
+			for (int i = 0; i < MARK_WORDS; i++) {
+				count += __builtin_popcountll(live[i]);
+			}
+			return count;
+		}
+	};
 
-	float  probability_acc;
-	size_t allocation_acc;
-	// Collect at least every N allocated bytes
-	const size_t allocation_tip_pt = 1024;
+	// Bytes of pages currently held from the system
+	size_t held_bytes;
 
+	Page * alloc_page(Page_Kind kind, size_t bytes)
+	{
+		void * memory;
+		if (posix_memalign(&memory, PAGE_SIZE, bytes) != 0) {
+			fatal("Out of memory");
+		}
+		auto page = (Page*) memory;
+		page->next = NULL;
+		page->kind = kind;
+		page->bytes = bytes;
+		held_bytes += bytes;
+		page->cells = ((uint8_t*) page) + Page::header_size();
+		memset(page->live, 0, sizeof(page->live));
+		page->clear_marks();
+		memset(page->remembered, 0, sizeof(page->remembered));
+		page->evacuating = false;
+		// A helper thread might come across a pointer into this page
+		// before long, and needs to see its header by then
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		return page;
+	}
+	void free_page(Page * page)
+	{
+		held_bytes -= page->bytes;
+		free(page);
+	}
+
+	struct Size_Class {
+		int cell_shift;
+		Page * pages;
+		// Where allocation has got to since the last major collection:
+		// the page and bitmap word it's in, the cells of that word not
+		// handed out yet, and the pages still to come
+		Page * current;
+		size_t word;
+		uint64_t free_bits;
+		Page * next_page;
+		void init(int cell_shift)
+		{
+			this->cell_shift = cell_shift;
+			pages = NULL;
+			rewind();
+		}
+		// Called after each major collection
+		void rewind()
+		{
+			current = NULL;
+			word = 0;
+			free_bits = 0;
+			next_page = pages;
+		}
+		void start_page(Page * page)
+		{
+			current = page;
+			word = 0;
+			free_bits = page->free_cells(0);
+		}
+		Page * add_page()
+		{
+			auto page = alloc_page(PAGE_SMALL, PAGE_SIZE);
+			page->cell_shift = cell_shift;
+			page->cell_size = ((size_t) 1) << cell_shift;
+			page->cell_count = (PAGE_SIZE - Page::header_size()) >> cell_shift;
+			page->next = pages;
+			pages = page;
+			return page;
+		}
+		void * alloc()
+		{
+			while (free_bits == 0) {
+				if (current && word + 1 < current->mark_word_count()) {
+					word++;
+					free_bits = current->free_cells(word);
+				} else if (next_page) {
+					auto page = next_page;
+					next_page = page->next;
+					if (!page->evacuating) {
+						start_page(page);
+					}
+				} else {
+					start_page(add_page());
+				}
+			}
+			size_t index = word * 64 + __builtin_ctzll(free_bits);
+			free_bits &= free_bits - 1;
+			Page::set(current->live, index, true);
+			return current->cell(index);
+		}
+	};
+
+	struct Young_Header {
+		size_t size;
+		// Where the object was copied to, once it has been
+		void * forwarded;
+	};
+
+	// An object along with how to trace its fields
+	struct Traceable {
+		void * object;
+		void (*trace)(void*);
+		template <typename T>
+		static Traceable of(T * object)
+		{
+			Traceable traceable;
+			traceable.object = object;
+			traceable.trace = [](void * object) { ((T*) object)->gc_mark(); };
+			return traceable;
+		}
+	};
+
+	/* Gray objects are taken off the gray list through a short queue,
+	 * and prefetched on the way in, so that by the time an object is
+	 * traced its fields are likely to be in cache already. (Tracing
+	 * straight off the top of the list wouldn't leave any time for
+	 * that, since tracing an object usually pushes the next one.)
+	 */
+	const size_t PREFETCH_DISTANCE = 8;
+	struct Prefetch_Queue {
+		Traceable entries[PREFETCH_DISTANCE];
+		size_t head;
+		size_t count;
+		void init()
+		{
+			head = 0;
+			count = 0;
+		}
+		// Returns false once `list` and the queue are both empty
+		bool next(List<Traceable> * list, Traceable * entry)
+		{
+			while (count < PREFETCH_DISTANCE && list->size > 0) {
+				auto incoming = (*list)[list->size - 1];
+				list->size--;
+				__builtin_prefetch(incoming.object);
+				entries[(head + count) % PREFETCH_DISTANCE] = incoming;
+				count++;
+			}
+			if (count == 0) {
+				return false;
+			}
+			*entry = entries[head];
+			head = (head + 1) % PREFETCH_DISTANCE;
+			count--;
+			return true;
+		}
+		// Puts whatever hasn't been traced yet back on `list`
+		void flush(List<Traceable> * list)
+		{
+			for (; count > 0; count--) {
+				list->push(entries[head]);
+				head = (head + 1) % PREFETCH_DISTANCE;
+			}
+		}
+	};
+
+	Size_Class size_classes[SIZE_CLASS_COUNT];
+	Page * large_pages;
+
+	List<Page*> nursery;
+	size_t nursery_index;
+	uint8_t * nursery_top;
+	uint8_t * nursery_limit;
+	size_t nursery_bytes;
+
+	List<Traceable> remembered;
+
+	// Set during a minor collection, when young objects get copied
+	bool copying;
+	// Set during a major collection that empties sparse pages, which
+	// moves old objects too
+	bool compacting;
+	// Whether a collection might move what a field points to, in
+	// which case the field needs writing back
+	bool moving()
+	{
+		return copying || compacting;
+	}
+	// Set from the start of a major collection's marking to its end,
+	// which can span many pauses
+	bool marking;
+	// Marked objects whose fields haven't been traced yet. Each
+	// marking thread has its own.
+	thread_local List<Traceable> gray;
+	// Objects copied during the current minor collection whose fields
+	// haven't been traced yet
+	List<Traceable> copied;
+	// Whether marking happens on helper threads while the program
+	// runs; see MARKING THREADS below
+	bool concurrent;
+	// Set by the helper threads once they have run out of work
+	bool helper_idle;
+	// How many gray objects each marking thread traces per pause while
+	// marking is in progress (0 to do it all at once)
+	size_t slice_budget;
+	// Nursery usage at the last pause
+	size_t nursery_bytes_at_pause;
+
+	// Bytes allocated in the old generation since the last major
+	// collection, and how many were live after it
+	size_t old_growth;
+	size_t old_live;
+	// See DEFAULT_GROWTH
+	double growth;
+	size_t min_heap;
+	// Whether sparse pages get compacted, and whether the next major
+	// collection is going to
+	bool compaction;
+	bool compact_next;
+	size_t collection_count;
+
+	// Pause times are counted in buckets of under 10us, under 100us
+	// and so on, with everything over 100ms in the last
+	const int PAUSE_BUCKETS = 6;
+	struct Stats {
+		size_t minor_collections;
+		size_t major_collections;
+		// Bytes the program has asked for, and how many of them have
+		// been freed again. Old objects take up whole cells, and are
+		// counted that way from when they get one.
+		size_t allocated_bytes;
+		size_t freed_bytes;
+		// Bytes of pages held after the last collection
+		size_t heap_bytes;
+		// What was live after the last major collection, and the most
+		// that has been after any of them
+		size_t live_bytes;
+		size_t live_objects;
+		size_t peak_live_bytes;
+		size_t pause_count;
+		double total_pause_ms;
+		double longest_pause_ms;
+		size_t pause_histogram[PAUSE_BUCKETS];
+	};
+	Stats stats;
+	// Whether to print `stats` at exit ($BADGE_GC_STATS or --gc-stats)
+	bool report_stats;
+	// Bytes asked for in the nursery since the last minor collection,
+	// and how many of them the current one has copied out
+	size_t nursery_requested;
+	size_t promoted_bytes;
+
+	// Every pause, in milliseconds, if $BADGE_GC_PAUSES is set
+	bool record_pauses;
+	List<double> pauses;
+
+	bool nursery_full()
+	{
+		return nursery_bytes >= NURSERY_PAGES * PAGE_SIZE;
+	}
 	bool should_collect()
 	{
+		#if RELEASE
+		if (concurrent) {
+			return nursery_full() || (marking && __atomic_load_n(&helper_idle, __ATOMIC_RELAXED));
+		}
 		return
-			probability_acc >= 1.0 ||
-			allocation_acc >= allocation_tip_pt;
+			nursery_full() ||
+			(marking && nursery_bytes - nursery_bytes_at_pause >= SLICE_INTERVAL);
+		#else
+		// Debug builds collect at every safepoint, which shakes out
+		// anything that isn't being traced properly
+		return true;
+		#endif
+	}
+	// How big the old generation can get before the next major
+	// collection
+	size_t heap_target()
+	{
+		size_t target = (size_t) (old_live * growth);
+		return target < min_heap ? min_heap : target;
+	}
+	bool major_due()
+	{
+		#if RELEASE
+		return old_live + old_growth >= heap_target();
+		#else
+		// Debug builds start one every other pause, so that marking
+		// is almost always in progress
+		return collection_count % 2 == 0;
+		#endif
 	}
-	void reset_heuristics()
+
+	void start_nursery_page(size_t index)
+	{
+		if (index == nursery.size) {
+			nursery.push(alloc_page(PAGE_NURSERY, PAGE_SIZE));
+		}
+		nursery_index = index;
+		nursery_top = nursery[index]->cells;
+		nursery_limit = ((uint8_t*) nursery[index]) + PAGE_SIZE;
+	}
+	/* MARKING THREADS
+	 *
+	 * $BADGE_GC_THREADS sets how many threads trace gray objects. With
+	 * more than one, the marking done during a pause is split between
+	 * the program's own thread and some helper threads.
+	 *
+	 * With $BADGE_GC_CONCURRENT set, the helpers do the marking while
+	 * the program runs instead, rather than a slice at a time during
+	 * pauses. The program still pauses when the nursery fills up, and
+	 * the helpers are stopped for each pause, since a minor collection
+	 * moves objects and the roots can only be traced with the program
+	 * stopped. Whatever the pause turned gray is then handed over and
+	 * the helpers carry on. Once they run out of work, the next
+	 * safepoint finishes marking.
+	 *
+	 * The helpers only mark, and only ever look at old objects, which
+	 * stay put (compaction moves them, but leaves the helpers out).
+	 * The remembered set catches anything the program stores into
+	 * them behind their backs, just as for incremental marking.
+	 * What they do need is to read each object sensibly while the
+	 * program might be changing it: Values are read a word at a time,
+	 * which is why this needs COMPACT_VALUES, and GC_List::push
+	 * publishes the new element before the size that covers it.
+	 *
+	 * Each marking thread works from a gray list of its own. When that
+	 * gets long, it puts the older half up for grabs, and a thread that
+	 * runs out of work takes from the others. A round of marking is
+	 * over once every thread is out of work at the same time (or has
+	 * used up its budget, or the program needs a pause).
+	 */
+	const size_t SHARE_THRESHOLD = 64;
+
+	struct Mark_Worker {
+		std::mutex mutex;
+		// Gray objects up for grabs
+		List<Traceable> shared;
+		// shared.size, for other threads to check without the lock;
+		// only changed with the lock held (see published())
+		std::atomic<size_t> available;
+	};
+	Mark_Worker * workers;
+	size_t worker_count;
+	std::thread * helpers;
+	size_t helper_count;
+
+	std::mutex round_mutex;
+	// Signalled whenever any of the below changes
+	std::condition_variable round_changed;
+	// Bumped at the start of each round
+	size_t round;
+	size_t round_budget;
+	// Helpers that haven't finished the current round yet
+	size_t helpers_running;
+	bool stop_requested;
+	bool helpers_quit;
+	std::mutex idle_mutex;
+	std::condition_variable idle_changed;
+	// Workers in the current round that have nothing to do, guarded by
+	// idle_mutex
+	size_t idle_workers;
+
+	// Moves everything in `from` onto the end of `to`
+	void take(List<Traceable> * to, List<Traceable> * from)
+	{
+		for (int i = 0; i < from->size; i++) {
+			to->push((*from)[i]);
+		}
+		from->size = 0;
+	}
+	// Called after changing worker->shared, with its lock held (or
+	// between rounds, when nobody else is looking)
+	void published(Mark_Worker * worker)
+	{
+		worker->available.store(worker->shared.size, std::memory_order_relaxed);
+	}
+	// Puts the older half of this thread's gray list up for grabs
+	void share(Mark_Worker * worker)
+	{
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		size_t half = gray.size / 2;
+		for (int i = 0; i < half; i++) {
+			worker->shared.push(gray[i]);
+		}
+		published(worker);
+		memmove(gray.arr, gray.arr + half, sizeof(Traceable) * (gray.size - half));
+		gray.size -= half;
+	}
+	size_t shared_size(Mark_Worker * worker)
 	{
-		probability_acc = 0.0;
-		allocation_acc = 0;
+		return worker->available.load(std::memory_order_relaxed);
 	}
-	void heuristic_return()
+	// Takes everything from `worker`, if it's us, or half of what it
+	// has otherwise
+	bool take_from(Mark_Worker * worker, bool own)
 	{
-		probability_acc += 0.1;
+		if (shared_size(worker) == 0) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		auto shared = &worker->shared;
+		size_t count = own ? shared->size : (shared->size + 1) / 2;
+		for (int i = shared->size - count; i < shared->size; i++) {
+			gray.push((*shared)[i]);
+		}
+		shared->size -= count;
+		published(worker);
+		return count > 0;
 	}
-	void heuristic_exit_scope()
+	bool find_work(size_t self)
 	{
-		probability_acc += 0.05;
+		if (take_from(&workers[self], true)) {
+			return true;
+		}
+		for (size_t i = 1; i < worker_count; i++) {
+			if (take_from(&workers[(self + i) % worker_count], false)) {
+				return true;
+			}
+		}
+		return false;
+	}
+	bool any_shared()
+	{
+		for (size_t i = 0; i < worker_count; i++) {
+			if (shared_size(&workers[i]) > 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+	// Wakes up any threads waiting in work() for something to do
+	void wake_idle()
+	{
+		std::lock_guard<std::mutex> lock(idle_mutex);
+		idle_changed.notify_all();
+	}
+	// One thread's part in a round of marking
+	void work(size_t self, size_t budget)
+	{
+		auto worker = &workers[self];
+		size_t traced = 0;
+		Prefetch_Queue queue;
+		queue.init();
+		Traceable entry;
+		while (true) {
+			bool stopped = false;
+			while (true) {
+				bool out_of_budget = budget && traced == budget;
+				if (out_of_budget || __atomic_load_n(&stop_requested, __ATOMIC_RELAXED)) {
+					queue.flush(&gray);
+					stopped = true;
+					break;
+				}
+				if (!queue.next(&gray, &entry)) {
+					break;
+				}
+				entry.trace(entry.object);
+				traced++;
+				if (gray.size > SHARE_THRESHOLD && shared_size(worker) == 0) {
+					share(worker);
+					wake_idle();
+				}
+			}
+			if (stopped) {
+				if (gray.size > 0) {
+					// Someone else can have the rest
+					std::lock_guard<std::mutex> lock(worker->mutex);
+					take(&worker->shared, &gray);
+					published(worker);
+				}
+				std::lock_guard<std::mutex> lock(idle_mutex);
+				idle_workers++;
+				idle_changed.notify_all();
+				return;
+			}
+			if (find_work(self)) {
+				continue;
+			}
+			// Wait until someone shares something, or everyone is out
+			// of work
+			std::unique_lock<std::mutex> lock(idle_mutex);
+			idle_workers++;
+			if (idle_workers == worker_count) {
+				idle_changed.notify_all();
+			}
+			while (true) {
+				auto finished = [] {
+					return
+						idle_workers == worker_count ||
+						__atomic_load_n(&stop_requested, __ATOMIC_RELAXED);
+				};
+				idle_changed.wait(lock, [&] { return finished() || any_shared(); });
+				if (finished()) {
+					return;
+				}
+				idle_workers--;
+				lock.unlock();
+				if (find_work(self)) {
+					break;
+				}
+				lock.lock();
+				idle_workers++;
+				if (idle_workers == worker_count) {
+					idle_changed.notify_all();
+				}
+			}
+		}
+	}
+	void helper_main(size_t self)
+	{
+		gray.alloc();
+		size_t seen = 0;
+		std::unique_lock<std::mutex> lock(round_mutex);
+		while (true) {
+			// A helper that only wakes up once the round is over can
+			// skip it
+			round_changed.wait(lock, [&] {
+				return helpers_quit || (round != seen && !stop_requested);
+			});
+			if (helpers_quit) {
+				break;
+			}
+			seen = round;
+			helpers_running++;
+			size_t budget = round_budget;
+			lock.unlock();
+			work(self, budget);
+			lock.lock();
+			helpers_running--;
+			if (helpers_running == 0) {
+				if (!stop_requested) {
+					__atomic_store_n(&helper_idle, true, __ATOMIC_RELAXED);
+				}
+				round_changed.notify_all();
+			}
+		}
+		gray.dealloc();
+	}
+	void start_helpers(size_t threads)
+	{
+		worker_count = threads;
+		workers = new Mark_Worker[worker_count];
+		for (size_t i = 0; i < worker_count; i++) {
+			workers[i].shared.alloc();
+			published(&workers[i]);
+		}
+		round = 0;
+		helpers_running = 0;
+		stop_requested = false;
+		helpers_quit = false;
+		helper_idle = true;
+		// When marking during pauses, the program's thread is worker 0
+		helper_count = concurrent ? threads : threads - 1;
+		size_t first = threads - helper_count;
+		helpers = new std::thread[helper_count];
+		for (size_t i = 0; i < helper_count; i++) {
+			helpers[i] = std::thread(helper_main, first + i);
+		}
+	}
+	void stop_helpers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(round_mutex);
+			helpers_quit = true;
+			round_changed.notify_all();
+		}
+		for (size_t i = 0; i < helper_count; i++) {
+			helpers[i].join();
+		}
+		delete[] helpers;
+		for (size_t i = 0; i < worker_count; i++) {
+			workers[i].shared.dealloc();
+		}
+		delete[] workers;
+	}
+	// Hands this thread's gray objects out between the workers, and
+	// sets the helpers going
+	void start_round(size_t budget)
+	{
+		std::lock_guard<std::mutex> lock(round_mutex);
+		for (int i = 0; i < gray.size; i++) {
+			workers[i % worker_count].shared.push(gray[i]);
+		}
+		for (size_t i = 0; i < worker_count; i++) {
+			published(&workers[i]);
+		}
+		gray.size = 0;
+		round_budget = budget;
+		idle_workers = 0;
+		stop_requested = false;
+		__atomic_store_n(&helper_idle, false, __ATOMIC_RELAXED);
+		round++;
+		round_changed.notify_all();
+	}
+	// Stops the helpers, and takes back whatever nobody got to
+	void end_round()
+	{
+		std::unique_lock<std::mutex> lock(round_mutex);
+		__atomic_store_n(&stop_requested, true, __ATOMIC_RELAXED);
+		wake_idle();
+		round_changed.wait(lock, [] { return helpers_running == 0; });
+		for (size_t i = 0; i < worker_count; i++) {
+			take(&gray, &workers[i].shared);
+			published(&workers[i]);
+		}
+	}
+	// Marking during a pause; returns true once there's nothing left
+	// gray
+	bool mark_in_parallel(size_t budget)
+	{
+		start_round(budget);
+		work(0, budget);
+		end_round();
+		return gray.size == 0;
+	}
+
+	size_t size_setting(const char * name, size_t fallback)
+	{
+		auto setting = getenv(name);
+		if (!setting) {
+			return fallback;
+		}
+		return strtoul(setting, NULL, 10);
+	}
+	// `name` is where the setting came from, for the error message
+	void set_growth(const char * setting, const char * name)
+	{
+		char * end;
+		double value = strtod(setting, &end);
+		if (end == setting || *end != '\0' || !(value > 1.0)) {
+			fatal("%s must be a number greater than 1, not '%s'", name, setting);
+		}
+		growth = value;
+	}
+	// Takes a number of bytes with an optional K, M or G suffix
+	void set_min_heap(const char * setting, const char * name)
+	{
+		char * end;
+		size_t value = strtoul(setting, &end, 10);
+		int shift = 0;
+		switch (*end) {
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		}
+		if (end == setting || *end != '\0' || !isdigit(setting[0])) {
+			fatal("%s must be a size in bytes, like 65536 or 64K, not '%s'", name, setting);
+		}
+		min_heap = value << shift;
 	}
-	
 	void init()
 	{
-		allocations.alloc();
-		reset_heuristics();
+		held_bytes = 0;
+		for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+			size_classes[i].init(SMALLEST_CELL_SHIFT + i);
+		}
+		large_pages = NULL;
+		nursery.alloc();
+		start_nursery_page(0);
+		nursery_bytes = 0;
+		nursery_bytes_at_pause = 0;
+		remembered.alloc();
+		gray.alloc();
+		copied.alloc();
+		copying = false;
+		compacting = false;
+		marking = false;
+		slice_budget = size_setting("BADGE_GC_SLICE", DEFAULT_SLICE_BUDGET);
+		#if COMPACT_VALUES
+		concurrent = getenv("BADGE_GC_CONCURRENT") != NULL;
+		#else
+		// The helpers could see a Value half-written
+		concurrent = false;
+		#endif
+		size_t threads = size_setting("BADGE_GC_THREADS", 1);
+		if (threads == 0) {
+			fatal("BADGE_GC_THREADS must be at least 1");
+		}
+		worker_count = 1;
+		helper_count = 0;
+		if (concurrent || threads > 1) {
+			start_helpers(threads);
+		}
+		old_growth = 0;
+		old_live = 0;
+		growth = DEFAULT_GROWTH;
+		if (auto setting = getenv("BADGE_GC_GROWTH")) {
+			set_growth(setting, "BADGE_GC_GROWTH");
+		}
+		min_heap = DEFAULT_MIN_HEAP;
+		if (auto setting = getenv("BADGE_GC_MIN_HEAP")) {
+			set_min_heap(setting, "BADGE_GC_MIN_HEAP");
+		}
+		compaction = getenv("BADGE_GC_COMPACT") != NULL;
+		compact_next = false;
+		collection_count = 0;
+		memset(&stats, 0, sizeof(stats));
+		report_stats = getenv("BADGE_GC_STATS") != NULL;
+		nursery_requested = 0;
+		promoted_bytes = 0;
+		record_pauses = getenv("BADGE_GC_PAUSES") != NULL;
+		pauses.alloc();
+	}
+	int compare_pauses(const void * a, const void * b)
+	{
+		double x = *((double*) a);
+		double y = *((double*) b);
+		return (x > y) - (x < y);
+	}
+	void report_pauses()
+	{
+		if (pauses.size == 0) {
+			fprintf(stderr, "gc: no pauses\n");
+			return;
+		}
+		qsort(pauses.arr, pauses.size, sizeof(double), compare_pauses);
+		auto percentile = [](double p) {
+			return pauses[(size_t) (p * (pauses.size - 1))];
+		};
+		fprintf(stderr, "gc: %zu pauses; p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n",
+				pauses.size, percentile(0.5), percentile(0.9), percentile(0.99),
+				pauses[pauses.size - 1]);
+	}
+	const char * pause_bucket_names[PAUSE_BUCKETS] = {
+		"under 10us", "under 100us", "under 1ms", "under 10ms", "under 100ms", "over 100ms",
+	};
+	void print_stats()
+	{
+		fprintf(stderr, "gc: %zu minor and %zu major collections\n",
+				stats.minor_collections, stats.major_collections);
+		fprintf(stderr, "gc: %zuKiB allocated, %zuKiB freed, %zuKiB held\n",
+				stats.allocated_bytes / 1024, stats.freed_bytes / 1024, stats.heap_bytes / 1024);
+		fprintf(stderr, "gc: %zuKiB in %zu objects live after the last major collection, at most %zuKiB\n",
+				stats.live_bytes / 1024, stats.live_objects, stats.peak_live_bytes / 1024);
+		fprintf(stderr, "gc: %zu pauses, %.3fms in total, longest %.3fms\n",
+				stats.pause_count, stats.total_pause_ms, stats.longest_pause_ms);
+		for (int i = 0; i < PAUSE_BUCKETS; i++) {
+			fprintf(stderr, "gc:   %-12s %zu\n", pause_bucket_names[i], stats.pause_histogram[i]);
+		}
 	}
 	void destroy()
 	{
-		allocations.dealloc();
+		if (report_stats) {
+			print_stats();
+		}
+		if (record_pauses) {
+			report_pauses();
+		}
+		if (helper_count > 0) {
+			stop_helpers();
+		}
+		for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+			auto page = size_classes[i].pages;
+			while (page) {
+				auto next = page->next;
+				free_page(page);
+				page = next;
+			}
+		}
+		while (large_pages) {
+			auto next = large_pages->next;
+			free_page(large_pages);
+			large_pages = next;
+		}
+		for (int i = 0; i < nursery.size; i++) {
+			free_page(nursery[i]);
+		}
+		nursery.dealloc();
+		remembered.dealloc();
+		gray.dealloc();
+		copied.dealloc();
+		pauses.dealloc();
 	}
-	void * raw_to_opaque(void * ptr)
+	void * alloc_large(size_t size)
 	{
-		return (void*) (((uint8_t*) ptr) + 1);
+		size_t bytes = (Page::header_size() + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		auto page = alloc_page(PAGE_LARGE, bytes);
+		// Every address in the object maps to cell 0
+		page->cell_shift = 63;
+		page->cell_size = size;
+		page->cell_count = 1;
+		Page::set(page->live, 0, true);
+		page->next = large_pages;
+		large_pages = page;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		return page->cells;
 	}
-	void * opaque_to_raw(void * ptr)
+	void * alloc_old(size_t size)
 	{
-		return (void*) (((uint8_t*) ptr) - 1);
+		if (size > LARGEST_CELL) {
+			old_growth += size;
+			return alloc_large(size);
+		}
+		int cell_shift = SMALLEST_CELL_SHIFT;
+		while ((((size_t) 1) << cell_shift) < size) {
+			cell_shift++;
+		}
+		old_growth += ((size_t) 1) << cell_shift;
+		stats.allocated_bytes += (((size_t) 1) << cell_shift) - size;
+		return size_classes[cell_shift - SMALLEST_CELL_SHIFT].alloc();
+	}
+	// Anything allocated while marking is in progress is kept until
+	// the next major collection
+	void * alloc_old_black(size_t size)
+	{
+		void * ptr = alloc_old(size);
+		if (marking) {
+			auto page = Page::of(ptr);
+			page->mark(page->cell_index(ptr));
+		}
+		return ptr;
 	}
 	void * alloc(size_t size)
 	{
-		allocation_acc += size;
-		void * ptr = malloc(size + 1);
-		allocations.push(ptr);
-		return raw_to_opaque(ptr);
+		stats.allocated_bytes += size;
+		if (size > LARGEST_CELL) {
+			return alloc_old_black(size);
+		}
+		size_t needed = (sizeof(Young_Header) + size + CELL_ALIGNMENT - 1) & ~(CELL_ALIGNMENT - 1);
+		if (nursery_top + needed > nursery_limit) {
+			start_nursery_page(nursery_index + 1);
+		}
+		auto header = (Young_Header*) nursery_top;
+		nursery_top += needed;
+		nursery_bytes += needed;
+		header->size = size;
+		header->forwarded = NULL;
+		nursery_requested += size;
+		return header + 1;
 	}
 	void release(void * ptr)
 	{
 		// do nothing!
 	}
-	void mark_opaque(void * ptr)
+
+	enum Trace_Result {
+		TRACE_NOTHING,
+		TRACE_COPIED,
+		TRACE_MARKED,
+	};
+	// `*traced` is set to the object that was traced, wherever it is
+	// now. (A helper thread can't just look at the field again
+	// afterwards, since the program might have changed it.)
+	Trace_Result trace_opaque(void ** field, void ** traced = NULL)
 	{
-		*((uint8_t*) opaque_to_raw(ptr)) = 1;
+		void * ptr = __atomic_load_n(field, __ATOMIC_RELAXED);
+		if (traced) {
+			*traced = ptr;
+		}
+		// Pairs with the fence in alloc_page()
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		auto page = Page::of(ptr);
+		if (page->kind == PAGE_NURSERY) {
+			if (!copying) {
+				// Between minor collections, anything old that points
+				// into the nursery is on the remembered set, and gets
+				// traced again at the next one
+				return TRACE_NOTHING;
+			}
+			auto header = ((Young_Header*) ptr) - 1;
+			if (header->forwarded) {
+				*field = header->forwarded;
+				if (traced) {
+					*traced = header->forwarded;
+				}
+				return TRACE_NOTHING;
+			}
+			void * copy = alloc_old_black(header->size);
+			memcpy(copy, ptr, header->size);
+			promoted_bytes += header->size;
+			header->forwarded = copy;
+			*field = copy;
+			if (traced) {
+				*traced = copy;
+			}
+			return TRACE_COPIED;
+		}
+		if (!marking) {
+			return TRACE_NOTHING;
+		}
+		size_t index = page->cell_index(ptr);
+		if (page->evacuating) {
+			// Once it's moved, its first word says where to
+			if (page->is_marked(index)) {
+				void * moved = *((void**) ptr);
+				*field = moved;
+				if (traced) {
+					*traced = moved;
+				}
+				return TRACE_NOTHING;
+			}
+			page->mark(index);
+			void * copy = alloc_old_black(page->cell_size);
+			memcpy(copy, ptr, page->cell_size);
+			// It's the same object, not growth
+			old_growth -= page->cell_size;
+			*((void**) ptr) = copy;
+			*field = copy;
+			if (traced) {
+				*traced = copy;
+			}
+			return TRACE_MARKED;
+		}
+		if (worker_count > 1) {
+			// Another thread could be marking the same object, or
+			// another in the same word
+			auto word = &page->marks[index / 64];
+			uint64_t bit = ((uint64_t) 1) << (index % 64);
+			if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+				return TRACE_NOTHING;
+			}
+			uint64_t before = __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+			return (before & bit) ? TRACE_NOTHING : TRACE_MARKED;
+		}
+		if (page->is_marked(index)) {
+			return TRACE_NOTHING;
+		}
+		page->mark(index);
+		return TRACE_MARKED;
+	}
+	/* Objects reached while marking are put on the gray list, and
+	 * objects just copied out of the nursery on the copied list, to
+	 * have their own fields traced later. Nothing recurses, so a long
+	 * chain of objects can't run the native stack out.
+	 */
+	template <typename T>
+	void trace(T ** field)
+	{
+		void * object;
+		auto result = trace_opaque((void**) field, &object);
+		if (result == TRACE_COPIED) {
+			copied.push(Traceable::of((T*) object));
+		} else if (result == TRACE_MARKED) {
+			gray.push(Traceable::of((T*) object));
+		}
 	}
-	bool is_marked_opaque(void * ptr)
+	// For memory whose contents are traced by whatever owns it, like
+	// the array behind a GC_List
+	void trace_leaf(void * field)
 	{
-		return *((uint8_t*) opaque_to_raw(ptr));
+		trace_opaque((void**) field);
 	}
-	void unmark_all()
+	// Called after storing something into `owner`
+	template <typename T>
+	void write_barrier(T * owner)
 	{
-		for (int i = 0; i < allocations.size; i++) {
-			*((uint8_t*) allocations[i]) = 0;
+		auto page = Page::of(owner);
+		if (page->kind == PAGE_NURSERY) {
+			return;
+		}
+		size_t index = page->cell_index(owner);
+		if (Page::test(page->remembered, index)) {
+			return;
 		}
+		Page::set(page->remembered, index, true);
+		remembered.push(Traceable::of(owner));
 	}
-	void free_unmarked()
+
+	/* COLLECTING
+	 *
+	 * The VM stops at a safepoint whenever should_collect() says so,
+	 * and the driver loop calls collect() with a function that traces
+	 * every root.
+	 *
+	 * Marking the old generation is incremental. It starts with a
+	 * minor collection, marks whatever the roots point to, and from
+	 * then on each pause traces up to slice_budget gray objects, in
+	 * between running the program. The write barrier doubles as the
+	 * barrier for this: anything stored into an old object puts it on
+	 * the remembered set, and while marking is in progress the next
+	 * minor collection makes everything on the remembered set gray
+	 * again, so nothing it now points to can be missed. Once there's
+	 * nothing left gray, one last minor collection (to catch anything
+	 * the roots or the remembered set picked up in the meantime)
+	 * finishes the job. (The tracing can also be shared between
+	 * threads; see MARKING THREADS above.)
+	 */
+	typedef void (*Root_Tracer)(void * context);
+
+	void minor(Root_Tracer trace_roots, void * context)
 	{
-		List<void*> new_allocations;
-		new_allocations.alloc();
-		for (int i = 0; i < allocations.size; i++) {
-			if (*((uint8_t*) allocations[i])) {
-				new_allocations.push(allocations[i]);
+		stats.minor_collections++;
+		promoted_bytes = 0;
+		copying = true;
+		trace_roots(context);
+		// Tracing these never remembers anything new, since nothing
+		// is stored during a collection
+		for (int i = 0; i < remembered.size; i++) {
+			auto entry = remembered[i];
+			entry.trace(entry.object);
+			auto page = Page::of(entry.object);
+			Page::set(page->remembered, page->cell_index(entry.object), false);
+			if (marking) {
+				gray.push(entry);
+			}
+		}
+		remembered.size = 0;
+		while (copied.size > 0) {
+			auto entry = copied[copied.size - 1];
+			copied.size--;
+			entry.trace(entry.object);
+		}
+		copying = false;
+		stats.freed_bytes += nursery_requested - promoted_bytes;
+		nursery_requested = 0;
+		// Everything reachable has been copied out, so the nursery is
+		// empty again
+		while (nursery.size > NURSERY_PAGES) {
+			free_page(nursery.pop());
+		}
+		start_nursery_page(0);
+		nursery_bytes = 0;
+	}
+	/* COMPACTING
+	 *
+	 * Sweeping leaves holes that only objects of the same size class
+	 * can fill, so after a spike a program can be left with pages that
+	 * each hold a few survivors. With $BADGE_GC_COMPACT set (or
+	 * --gc-compact), a major collection that leaves the small pages
+	 * less than half full picks the sparsest pages of each size class
+	 * for evacuation, as many as the rest of the class has room for.
+	 * Nothing more is allocated on them, and the next pause starts a
+	 * compacting collection.
+	 *
+	 * That one isn't incremental, and doesn't share its marking with
+	 * the helpers, since it moves old objects and the helpers assume
+	 * old objects stay put. Marking copies anything it reaches on an
+	 * evacuating page elsewhere, just like a minor collection copies
+	 * out of the nursery, and leaves the new address in the first word
+	 * of the old copy, which its mark bit says is now a forwarding
+	 * address. Every field that points to an old object is traced
+	 * during marking, so by the end nothing points into the evacuated
+	 * pages, and they're freed along with any other empty pages.
+	 */
+	const size_t MIN_COMPACT_PAGES = 16;
+
+	int compare_live_counts(const void * a, const void * b)
+	{
+		size_t x = (*((Page**) a))->live_count();
+		size_t y = (*((Page**) b))->live_count();
+		return (x > y) - (x < y);
+	}
+	void choose_evacuees(Size_Class * size_class)
+	{
+		List<Page*> pages;
+		pages.alloc();
+		defer { pages.dealloc(); };
+		size_t free_cells = 0;
+		for (auto page = size_class->pages; page; page = page->next) {
+			pages.push(page);
+			free_cells += page->cell_count - page->live_count();
+		}
+		qsort(pages.arr, pages.size, sizeof(Page*), compare_live_counts);
+		size_t moving = 0;
+		for (int i = 0; i < pages.size; i++) {
+			auto page = pages[i];
+			size_t live = page->live_count();
+			if (live * 2 > page->cell_count) {
+				break;
+			}
+			// Nothing gets moved onto the page once it's chosen
+			free_cells -= page->cell_count - live;
+			if (moving + live > free_cells) {
+				break;
+			}
+			moving += live;
+			page->evacuating = true;
+		}
+	}
+	// Decides whether the next major collection compacts, from what
+	// this one left behind
+	void plan_compaction(size_t page_count, size_t live_bytes)
+	{
+		compact_next =
+			compaction &&
+			page_count >= MIN_COMPACT_PAGES &&
+			live_bytes < page_count * PAGE_SIZE / 2;
+		if (compact_next) {
+			for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+				choose_evacuees(&size_classes[i]);
+			}
+		}
+	}
+
+	void begin_marking(Root_Tracer trace_roots, void * context)
+	{
+		assert(remembered.size == 0 && nursery_bytes == 0);
+		stats.major_collections++;
+		for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+			auto size_class = &size_classes[i];
+			for (auto page = size_class->pages; page; page = page->next) {
+				page->clear_marks();
+			}
+		}
+		for (auto page = large_pages; page; page = page->next) {
+			page->clear_marks();
+		}
+		marking = true;
+		trace_roots(context);
+	}
+	// Returns true once there's nothing left gray
+	bool mark_slice(size_t budget)
+	{
+		Prefetch_Queue queue;
+		queue.init();
+		Traceable entry;
+		for (size_t i = 0; budget == 0 || i < budget; i++) {
+			// Once there's enough to go round, the helpers join in
+			size_t remaining = budget == 0 ? 0 : budget - i;
+			bool worth_sharing =
+				gray.size > SHARE_THRESHOLD &&
+				(remaining == 0 || remaining > SHARE_THRESHOLD);
+			if (helper_count > 0 && !concurrent && !compacting && worth_sharing) {
+				queue.flush(&gray);
+				return mark_in_parallel(remaining);
+			}
+			if (!queue.next(&gray, &entry)) {
+				break;
+			}
+			entry.trace(entry.object);
+		}
+		queue.flush(&gray);
+		return gray.size == 0;
+	}
+	// Frees empty pages beyond the first `spare` bytes' worth, and
+	// returns how many it freed
+	size_t free_empty_pages(size_t spare)
+	{
+		size_t kept = 0;
+		size_t freed = 0;
+		for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+			auto link = &size_classes[i].pages;
+			while (*link) {
+				auto page = *link;
+				if (page->live_count() > 0) {
+					link = &page->next;
+				} else if (kept + PAGE_SIZE <= spare) {
+					kept += PAGE_SIZE;
+					link = &page->next;
+				} else {
+					*link = page->next;
+					free_page(page);
+					freed++;
+				}
+			}
+		}
+		return freed;
+	}
+	void finish_marking(Root_Tracer trace_roots, void * context)
+	{
+		minor(trace_roots, context);
+		mark_slice(0);
+		marking = false;
+		size_t live_objects = 0;
+		size_t live_bytes = 0;
+		auto large = &large_pages;
+		while (*large) {
+			auto page = *large;
+			if (page->is_marked(0)) {
+				page->sweep();
+				live_objects++;
+				live_bytes += page->cell_size;
+				large = &page->next;
 			} else {
-				free(allocations[i]);
+				*large = page->next;
+				free_page(page);
+			}
+		}
+		// Small pages are swept as they're needed
+		size_t page_count = 0;
+		size_t small_bytes = 0;
+		size_t freed_pages = 0;
+		for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+			auto size_class = &size_classes[i];
+			auto link = &size_class->pages;
+			while (*link) {
+				auto page = *link;
+				if (page->evacuating) {
+					*link = page->next;
+					free_page(page);
+					freed_pages++;
+					continue;
+				}
+				page->sweep();
+				size_t live = page->live_count();
+				if (live > 0) {
+					page_count++;
+					live_objects += live;
+					small_bytes += live * page->cell_size;
+				}
+				link = &page->next;
 			}
 		}
-		#if SHOW_TOTAL_ALLOCATIONS
-		printf("\n-- %zu allocations\n\n", new_allocations.size);
+		compacting = false;
+		live_bytes += small_bytes;
+		size_t old_before = old_live + old_growth;
+		if (old_before > live_bytes) {
+			stats.freed_bytes += old_before - live_bytes;
+		}
+		stats.live_bytes = live_bytes;
+		stats.live_objects = live_objects;
+		if (live_bytes > stats.peak_live_bytes) {
+			stats.peak_live_bytes = live_bytes;
+		}
+		old_live = live_bytes;
+		old_growth = 0;
+		// Empty pages are kept for as much as can be allocated before
+		// the next major collection, and the rest given back
+		freed_pages += free_empty_pages(heap_target() - old_live);
+		#ifdef __GLIBC__
+		// Otherwise malloc holds on to them
+		if (freed_pages > 0) {
+			malloc_trim(0);
+		}
 		#endif
-		#if SHOW_COLLECTIONS
-		printf("\n-- %zu collections\n\n", allocations.size - new_allocations.size);
+		for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+			size_classes[i].rewind();
+		}
+		plan_compaction(page_count, small_bytes);
+	}
+	double milliseconds()
+	{
+		struct timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+	}
+	void record_pause(double ms)
+	{
+		stats.pause_count++;
+		stats.total_pause_ms += ms;
+		if (ms > stats.longest_pause_ms) {
+			stats.longest_pause_ms = ms;
+		}
+		int bucket = 0;
+		for (double limit = 0.01; bucket < PAUSE_BUCKETS - 1 && ms >= limit; limit *= 10) {
+			bucket++;
+		}
+		stats.pause_histogram[bucket]++;
+		if (record_pauses) {
+			pauses.push(ms);
+		}
+	}
+	// `halting` is set once the program is over, to free everything
+	void collect(bool halting, Root_Tracer trace_roots, void * context)
+	{
+		double start = milliseconds();
+		// The collection at exit just frees everything, which would
+		// only muddy the stats
+		Stats before = stats;
+		collection_count++;
+		// Whether the marking threads have run out of work
+		bool helpers_finished = false;
+		if (concurrent && marking) {
+			end_round();
+			helpers_finished = gray.size == 0;
+		}
+		bool minor_done = false;
+		#if RELEASE
+		if (halting || nursery_full()) {
 		#endif
-		allocations.dealloc();
-		allocations = new_allocations;
+			minor(trace_roots, context);
+			minor_done = true;
+		#if RELEASE
+		}
+		#endif
+		if (marking) {
+			bool finished = concurrent
+				? helpers_finished || halting
+				: mark_slice(halting ? 0 : slice_budget);
+			if (finished) {
+				finish_marking(trace_roots, context);
+			}
+		} else if (halting || compact_next || major_due()) {
+			if (!minor_done) {
+				minor(trace_roots, context);
+			}
+			compacting = compact_next;
+			begin_marking(trace_roots, context);
+			if (halting || compacting || (!concurrent && slice_budget == 0)) {
+				finish_marking(trace_roots, context);
+			}
+		}
+		if (concurrent && marking) {
+			if (gray.size > 0) {
+				start_round(0);
+			} else {
+				__atomic_store_n(&helper_idle, true, __ATOMIC_RELAXED);
+			}
+		}
+		nursery_bytes_at_pause = nursery_bytes;
+		if (halting) {
+			stats = before;
+		} else {
+			stats.heap_bytes = held_bytes;
+			record_pause(milliseconds() - start);
+		}
 	}
-	
+
 	Allocator allocator = Allocator::construct(alloc, release);
 }
@@ -0,0 +1,229 @@
+/* INTEGER INFERENCE
+ *
+ * Works out, for every binary arithmetic or comparison operator in a
+ * block, whether both of its operands are certain to be integers. The
+ * compiler emits the unchecked _INT_UNCHECKED instructions for those.
+ *
+ * Arithmetic always produces an integer (or doesn't return at all),
+ * and so do the MOD, ABS and ARRAY_LEN intrinsics, so the interesting
+ * part is following locals around. Only slots of a frame that nothing
+ * closes over can be followed, since nothing else can change them
+ * behind our back; everything else is assumed to be anything. A local only counts
+ * as an integer at a given point if it's one along every path there,
+ * and loops are walked repeatedly until what we know at the top of the
+ * loop stops changing.
+ *
+ * Lambda bodies are left alone; each gets its own pass when the
+ * compiler reaches it.
+ */
+
+struct Int_State {
+	bool reachable;
+	// Bit n is set if frame slot n certainly holds an integer. Slots
+	// past the first 64 are never followed.
+	uint64_t integers;
+	static Int_State entry()
+	{
+		return (Int_State) { true, 0 };
+	}
+	// Code that can't be reached may as well assume anything
+	static Int_State unreachable()
+	{
+		return (Int_State) { false, ~((uint64_t) 0) };
+	}
+	static Int_State meet(Int_State a, Int_State b)
+	{
+		return (Int_State) { a.reachable || b.reachable, a.integers & b.integers };
+	}
+	bool same_as(Int_State other)
+	{
+		return reachable == other.reachable && integers == other.integers;
+	}
+	bool is_integer(int slot)
+	{
+		if (slot >= 64) {
+			return false;
+		}
+		return (integers >> slot) & 1;
+	}
+	void set_integer(int slot, bool integer)
+	{
+		if (slot >= 64) {
+			return;
+		}
+		uint64_t bit = ((uint64_t) 1) << slot;
+		integers = integer ? (integers | bit) : (integers & ~bit);
+	}
+};
+
+struct Int_Inference {
+	File_Constants * constants;
+	Int_State state;
+	// Everything known at each `break` out of the loops we're inside
+	List<Int_State> loop_exits;
+	void init(File_Constants * constants)
+	{
+		this->constants = constants;
+		loop_exits.alloc();
+	}
+	void destroy()
+	{
+		assert(loop_exits.size == 0);
+		loop_exits.dealloc();
+	}
+	void infer_function(Expr * lambda)
+	{
+		assert(lambda->kind == EXPR_LAMBDA);
+		// Parameters could be anything
+		state = Int_State::entry();
+		infer_expr(lambda->lambda.body);
+	}
+	void infer_top_level(Stmt * stmt)
+	{
+		state = Int_State::entry();
+		infer_stmt(stmt);
+	}
+	void assign(Local_Address address, bool integer)
+	{
+		if (address.kind == ADDRESS_FRAME) {
+			state.set_integer(address.slot, integer);
+		}
+	}
+	static bool is_arithmetic(Operator op)
+	{
+		return
+			op == OP_ADD ||
+			op == OP_SUBTRACT ||
+			op == OP_MULTIPLY ||
+			op == OP_DIVIDE;
+	}
+	// Returns whether `expr` certainly evaluates to an integer
+	bool infer_expr(Expr * expr)
+	{
+		switch (expr->kind) {
+		case EXPR_NOTHING:
+		case EXPR_STRING:
+		case EXPR_THIS:
+		case EXPR_LAMBDA:
+		case EXPR_DIRECTIVE:
+			return false;
+		case EXPR_INTEGER:
+			return true;
+		case EXPR_VARIABLE: {
+			auto address = expr->variable.address;
+			return address.kind == ADDRESS_FRAME && state.is_integer(address.slot);
+		}
+		case EXPR_UNARY:
+			infer_expr(expr->unary.expr);
+			return expr->unary.op == OP_NEGATE;
+		case EXPR_BINARY: {
+			bool left = infer_expr(expr->binary.left);
+			bool right = infer_expr(expr->binary.right);
+			expr->binary.integer_operands = left && right;
+			return is_arithmetic(expr->binary.op);
+		}
+		case EXPR_SCOPE: {
+			auto body = expr->scope.body;
+			for (int i = 0; i < body.size; i++) {
+				infer_stmt(body[i]);
+			}
+			if (expr->scope.terminator) {
+				return infer_expr(expr->scope.terminator);
+			}
+			return false;
+		}
+		case EXPR_FUNCALL: {
+			auto args = expr->funcall.args;
+			for (int i = args.size - 1; i >= 0; i--) {
+				infer_expr(args[i]);
+			}
+			infer_expr(expr->funcall.func);
+			auto intrinsic = constants ? constants->intrinsic_for(expr) : BC_NOP;
+			return intrinsic == BC_MOD || intrinsic == BC_ABS || intrinsic == BC_ARRAY_LEN;
+		}
+		case EXPR_IF: {
+			auto _if = expr->if_expr;
+			auto after = Int_State::unreachable();
+			bool integer = true;
+			for (int i = 0; i < _if.conditions.size; i++) {
+				infer_expr(_if.conditions[i]);
+				auto not_taken = state;
+				integer = infer_expr(_if.expressions[i]) && integer;
+				after = Int_State::meet(after, state);
+				state = not_taken;
+			}
+			if (_if.else_expr) {
+				integer = infer_expr(_if.else_expr) && integer;
+			} else {
+				integer = false;
+			}
+			state = Int_State::meet(after, state);
+			return integer;
+		}
+		case EXPR_FIELD:
+			infer_expr(expr->field.left);
+			return false;
+		case EXPR_LOOP: {
+			auto entry = state;
+			auto head = entry;
+			while (true) {
+				loop_exits.push(Int_State::unreachable());
+				state = head;
+				infer_expr(expr->loop.body);
+				auto exits = loop_exits.pop();
+				// The body's value decides whether we go round again
+				// or leave, so both start from here
+				auto end = state;
+				auto next_head = Int_State::meet(entry, end);
+				if (next_head.same_as(head)) {
+					state = Int_State::meet(exits, end);
+					break;
+				}
+				head = next_head;
+			}
+			return false;
+		}
+		case EXPR_ON: {
+			auto not_taken = state;
+			assign(expr->on.address, false);
+			infer_expr(expr->on.body);
+			state = Int_State::meet(not_taken, state);
+			return false;
+		}
+		}
+		assert(false); // @linter
+	}
+	void infer_stmt(Stmt * stmt)
+	{
+		switch (stmt->kind) {
+		case STMT_LET: {
+			bool integer = infer_expr(stmt->let.right);
+			assign(stmt->let.address, integer);
+		} break;
+		case STMT_SET: {
+			bool integer = infer_expr(stmt->set.right);
+			auto left = stmt->set.left;
+			if (left->kind == EXPR_VARIABLE) {
+				assign(left->variable.address, integer);
+			} else if (left->kind == EXPR_FIELD) {
+				infer_expr(left->field.left);
+			}
+		} break;
+		case STMT_RETURN:
+			infer_expr(stmt->_return.expr);
+			state = Int_State::unreachable();
+			break;
+		case STMT_EXPR:
+			infer_expr(stmt->expr);
+			break;
+		case STMT_BREAK:
+			infer_expr(stmt->_break);
+			if (loop_exits.size > 0) {
+				auto exits = &loop_exits[loop_exits.size - 1];
+				*exits = Int_State::meet(*exits, state);
+			}
+			state = Int_State::unreachable();
+			break;
+		}
+	}
+};
@@ -1,30 +1,171 @@
 typedef const char * Symbol;
+typedef uint32_t Symbol_ID;
+
+/* INTERNING
+ *
+ * Every distinct string gets one Symbol, so symbols can be compared
+ * by pointer. Interned strings are copied into an arena of big chunks
+ * that live until the program exits, and found again through a hash
+ * table with open addressing that's kept at most half full. Each slot
+ * holds the hash and length alongside the symbol, so most slots can
+ * be ruled out without looking at the characters.
+ *
+ * Symbols are also numbered from zero in the order they're interned,
+ * so that anything keyed by symbol can be a table indexed directly by
+ * ID (see Symbol_Table) rather than a list that has to be searched.
+ * The ID is kept in the arena just before the symbol's characters.
+ */
 
 namespace Intern {
-	List<Symbol> interns;
+	const size_t CHUNK_SIZE = 64 * 1024;
+	const size_t INITIAL_CAPACITY = 256;
+	struct Slot {
+		uint64_t hash;
+		size_t length;
+		// NULL if the slot is free
+		Symbol symbol;
+	};
+	Slot * table;
+	size_t capacity;
+	// Every symbol, by ID
+	List<Symbol> symbols;
+	List<char*> chunks;
+	char * chunk_cursor;
+	size_t chunk_left;
 	void init()
 	{
-		interns.alloc();
+		capacity = INITIAL_CAPACITY;
+		table = (Slot*) calloc(capacity, sizeof(Slot));
+		symbols.alloc();
+		chunks.alloc();
+		chunk_cursor = NULL;
+		chunk_left = 0;
 	}
 	void destroy()
 	{
-		for (int i = 0; i < interns.size; i++) {
-			free((void*) interns[i]);
+		for (int i = 0; i < chunks.size; i++) {
+			free(chunks[i]);
 		}
-		interns.dealloc();
+		chunks.dealloc();
+		symbols.dealloc();
+		free(table);
 	}
-	Symbol intern(const char * s)
+	// Copies `length` characters into the arena, after the ID and
+	// with a terminator
+	char * copy(const char * s, size_t length, Symbol_ID id)
+	{
+		// Keeps the next ID aligned
+		size_t size = (sizeof(Symbol_ID) + length + 1 + alignof(Symbol_ID) - 1) &
+			~(alignof(Symbol_ID) - 1);
+		char * start;
+		if (size <= chunk_left) {
+			start = chunk_cursor;
+			chunk_cursor += size;
+			chunk_left -= size;
+		} else if (size > CHUNK_SIZE / 4) {
+			// Strings too big for a chunk get one to themselves,
+			// leaving the current chunk to carry on with
+			start = (char*) malloc(size);
+			chunks.push(start);
+		} else {
+			start = (char*) malloc(CHUNK_SIZE);
+			chunks.push(start);
+			chunk_cursor = start + size;
+			chunk_left = CHUNK_SIZE - size;
+		}
+		*(Symbol_ID*) start = id;
+		char * copy = start + sizeof(Symbol_ID);
+		memcpy(copy, s, length);
+		copy[length] = '\0';
+		return copy;
+	}
+	void grow()
+	{
+		auto old = table;
+		size_t old_capacity = capacity;
+		capacity *= 2;
+		table = (Slot*) calloc(capacity, sizeof(Slot));
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (!old[i].symbol) {
+				continue;
+			}
+			size_t j = old[i].hash & mask;
+			while (table[j].symbol) {
+				j = (j + 1) & mask;
+			}
+			table[j] = old[i];
+		}
+		free(old);
+	}
+	// `s` needn't be terminated
+	Symbol intern(const char * s, size_t length)
 	{
-		for (int i = 0; i < interns.size; i++) {
-			if (strcmp(s, interns[i]) == 0) {
-				return interns[i];
+		uint64_t hash = hash_bytes(s, length);
+		size_t mask = capacity - 1;
+		size_t i = hash & mask;
+		for (; table[i].symbol; i = (i + 1) & mask) {
+			auto slot = &table[i];
+			if (slot->hash == hash && slot->length == length &&
+				memcmp(slot->symbol, s, length) == 0) {
+				return slot->symbol;
 			}
 		}
-		interns.push(strdup(s));
-		return interns[interns.size - 1];
+		Symbol symbol = copy(s, length, symbols.size);
+		symbols.push(symbol);
+		table[i] = (Slot) { hash, length, symbol };
+		if (symbols.size * 2 > capacity) {
+			grow();
+		}
+		return symbol;
+	}
+	Symbol intern(const char * s)
+	{
+		return intern(s, strlen(s));
+	}
+	Symbol_ID id_of(Symbol symbol)
+	{
+		auto id = ((const Symbol_ID*) symbol)[-1];
+		assert(id < symbols.size && symbols[id] == symbol);
+		return id;
+	}
+	Symbol symbol_of(Symbol_ID id)
+	{
+		return symbols[id];
 	}
 }
 
+/* A table from symbols to values, indexed directly by symbol ID.
+ * Symbols that haven't been given a value read as `missing`.
+ */
+template <typename V>
+struct Symbol_Table {
+	List<V> values;
+	V missing;
+	void alloc(V missing)
+	{
+		values.alloc();
+		this->missing = missing;
+	}
+	void dealloc()
+	{
+		values.dealloc();
+	}
+	V get(Symbol symbol)
+	{
+		auto id = Intern::id_of(symbol);
+		return id < values.size ? values[id] : missing;
+	}
+	void set(Symbol symbol, V value)
+	{
+		auto id = Intern::id_of(symbol);
+		while (values.size <= id) {
+			values.push(missing);
+		}
+		values[id] = value;
+	}
+};
+
 bool symbol_comparator(Symbol a, Symbol b) {
 	return a == b;
 }
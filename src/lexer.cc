@@ -190,36 +190,34 @@ Token Lexer::next_token()
 	if (peek() == '"') {
 		size_t start = cursor;
 		advance();
-		
-		String_Builder builder;
 		while (peek() != '"') {
-			builder.add(next());
+			advance();
 		}
 		advance();
-		char * s = builder.final_string();
-		defer { free(s); };
 		
 		Token token = create_token(TOKEN_STRING_LITERAL, cursor - start);
-		token.values.string = Intern::intern(s); // string literals are technically symbols
+		// String literals are technically symbols
+		token.values.string = Intern::intern(source + start + 1, cursor - start - 2);
 		return token;
 	}
 	
 	if (isalpha(peek()) || peek() == '_') {
-		String_Builder builder;
+		size_t start = cursor;
 		while (isalnum(peek()) || peek() == '_') {
-			builder.add(next());
+			advance();
 		}
-		char * s = builder.final_string();
-		defer { free(s); };
+		const char * s = source + start;
+		size_t length = cursor - start;
 		
 		for (int i = 0; i < RESERVED_WORDS_COUNT; i++) {
-			if (strcmp(s, reserved_words[i]) == 0) {
-				return create_token((Token_Kind) (RESERVED_WORDS_BEGIN + i), builder.size());
+			if (strncmp(s, reserved_words[i], length) == 0 &&
+				reserved_words[i][length] == '\0') {
+				return create_token((Token_Kind) (RESERVED_WORDS_BEGIN + i), length);
 			}
 		}
 		
-		Token token = create_token(TOKEN_SYMBOL, builder.size());
-		token.values.symbol = Intern::intern(s);
+		Token token = create_token(TOKEN_SYMBOL, length);
+		token.values.symbol = Intern::intern(s, length);
 		return token;
 	}
 
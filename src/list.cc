@@ -23,6 +23,7 @@ struct List {
 	void dealloc();
 	void resize(size_t new_capacity);
 	void possibly_grow_to_size(size_t new_size);
+	void reserve(size_t min_capacity);
 	void push(T to_push);
 	void possibly_shrink_to_size(size_t query_size);
 	T pop();
@@ -87,6 +88,14 @@ void List<T>::possibly_grow_to_size(size_t query_size)
 	}
 }
 
+template <typename T>
+void List<T>::reserve(size_t min_capacity)
+{
+	if (min_capacity > capacity) {
+		resize(min_capacity);
+	}
+}
+
 template <typename T>
 void List<T>::push(T to_push)
 {
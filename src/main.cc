@@ -1,4 +1,6 @@
 #define TAIL_CALL_OPTIMIZATION true
+#define THREADED_DISPATCH true
+#define COMPACT_VALUES true
 
 #include "includes.cc"
 #include "defer.cc"
@@ -7,13 +9,14 @@
 #include "global_alloc.cc"
 #include "map.cc"
 #include "string-builder.cc"
-#include "intern.cc"
 #include "utility.cc"
+#include "intern.cc"
 #include "error.cc"
 #include "files.cc"
 #include "lexer.cc"
 #include "ast.cc"
 #include "parser.cc"
+#include "resolver.cc"
 #include "gc.cc"
 #include "gc-structs.cc"
 #include "value-decl.cc"
@@ -22,13 +25,17 @@
 #include "value-def.cc"
 #include "blocks.cc"
 #include "builtins.cc"
+#include "constants.cc"
+#include "inference.cc"
+#include "peephole.cc"
 #include "compiler.cc"
 #include "vm.cc"
 
 #define OUTPUT_BYTECODE false
 #define DEBUG_OUTPUT false
 
-const char * load_and_compile_file(Blocks * blocks, const char * filename)
+const char * load_and_compile_file(Blocks * blocks, const char * filename,
+								   List<Symbol> * exports)
 {
 	const char * source = load_string_from_file(filename);
 	if (!source) {
@@ -39,35 +46,78 @@ const char * load_and_compile_file(Blocks * blocks, const char * filename)
 	Parser parser;
 	parser.init(&lexer);
 
-	Compiler compiler;
-	compiler.init(blocks);
+	// The parser feeds from the lexer and returns one statement's
+	// worth of abstract syntax tree. We need the whole file up front
+	// so that we know which globals never change.
+	List<Stmt*> stmts;
+	stmts.alloc();
+	defer {
+		for (int i = 0; i < stmts.size; i++) {
+			stmts[i]->destroy();
+			free(stmts[i]);
+		}
+		stmts.dealloc();
+	};
 	while (!parser.is(TOKEN_EOF)) {
-		// The parser feeds from the lexer and returns one
-		// statement's worth of abstract syntax tree
-		auto stmt = parser.parse_stmt();
-		defer {
-			stmt->destroy();
-			free(stmt);
-		};
-		
+		stmts.push(parser.parse_stmt());
 		// Top-level expects terminators for every statement
 		parser.expect('.');
+	}
 
-		// Here we generate bytecode from our abstract syntax tree
-		// (one statement's worth)
-		compiler.compile_stmt(stmt);
+	// Work out where every local variable will live
+	Resolver resolver;
+	resolver.init();
+	for (int i = 0; i < stmts.size; i++) {
+		resolver.resolve(stmts[i]);
+	}
+
+	File_Constants constants;
+	constants.init(&resolver);
+
+	// Here we generate bytecode from our abstract syntax tree
+	Compiler compiler;
+	compiler.init(blocks);
+	compiler.constants = &constants;
+	for (int i = 0; i < stmts.size; i++) {
+		compiler.compile_top_level_stmt(stmts[i]);
 	}
 
 	// Because file scopes are called just like functions, they need
 	// to leave something behind on the stack.
 	compiler.push(BC::create(BC_LOAD_CONST, Value::nothing(), -1));
 	
+	compiler.slot_count = resolver.file_slot_count();
 	compiler.finalize();
 	compiler.destroy();
 
+	constants.record_exports();
+	if (exports) {
+		for (int i = 0; i < constants.exports.size; i++) {
+			exports->push(constants.exports[i]);
+		}
+	}
+	constants.destroy();
+	resolver.destroy();
+
 	return source;
 }
 
+struct Roots {
+	List<VM> * vm_stack;
+	// Also held by every VM, but this copy is the one new VMs are
+	// given, so it has to be kept up to date too
+	Environment ** export_scope;
+};
+
+void trace_roots(void * context)
+{
+	auto roots = (Roots*) context;
+	GC::trace(roots->export_scope);
+	for (int i = 0; i < roots->vm_stack->size; i++) {
+		(*roots->vm_stack)[i].mark_reachable();
+	}
+}
+
 void work_from_source(const char * path)
 {
 	/*
@@ -90,10 +140,19 @@ void work_from_source(const char * path)
 		}*/
 
 	Blocks blocks;
-	blocks.init();
-	const char * source = load_and_compile_file(&blocks, path);
-	if (!source) {
-		fatal("File '%s' does not exist!", path);
+	while (true) {
+		blocks.init();
+		const char * source = load_and_compile_file(&blocks, path);
+		if (!source) {
+			fatal("File '%s' does not exist!", path);
+		}
+		if (!Constants::invalidated) {
+			break;
+		}
+		// Something we assumed about an imported name turned out to
+		// be wrong, so start over without it
+		blocks.destroy();
+		Constants::reset();
 	}
 
 	#if OUTPUT_BYTECODE
@@ -124,9 +183,9 @@ void work_from_source(const char * path)
 
 	while (vm_stack.size > 0) {
 		auto vm = &vm_stack[vm_stack.size - 1];
-		auto response = vm->step();
+		auto response = vm->run();
 		switch (response) {
-		case VM_OK:
+		case VM_COLLECT:
 			break;
 		case VM_HALTED: {
 			vm->destroy();
@@ -149,17 +208,12 @@ void work_from_source(const char * path)
 		// anything that needs to get cleaned up, will be.
 		#if COLLECTION
 		do {
-			#if RELEASE
-			if (!GC::should_collect()) {
+			if (vm_stack.size > 0 && !GC::should_collect()) {
 				break;
 			}
-			GC::reset_heuristics();
-			#endif
-			GC::unmark_all();
-			for (int i = 0; i < vm_stack.size; i++) {
-				vm_stack[i].mark_reachable();
-			}
-			GC::free_unmarked();
+			Roots roots = { &vm_stack, &export_scope };
+			// Once the last VM has halted, clear out everything
+			GC::collect(vm_stack.size == 0, trace_roots, &roots);
 		} while(0);
 		#endif
 	}
@@ -170,24 +224,92 @@ void work_from_source(const char * path)
 	blocks.destroy();
 }
 
+// Matches `--name value` or `--name=value` at argv[*i], moving *i past
+// whatever it uses
+bool match_option(const char * name, int argc, char ** argv, int * i, const char ** value)
+{
+	size_t length = strlen(name);
+	auto arg = argv[*i];
+	if (strncmp(arg, name, length) != 0) {
+		return false;
+	}
+	if (arg[length] == '=') {
+		*value = arg + length + 1;
+		return true;
+	}
+	if (arg[length] != '\0') {
+		return false;
+	}
+	if (*i + 1 >= argc) {
+		fatal("%s needs a value", name);
+	}
+	*i += 1;
+	*value = argv[*i];
+	return true;
+}
+
 int main(int argc, char ** argv)
 {	
-	if (argc != 2) {
+	const char * path = NULL;
+	const char * gc_growth = NULL;
+	const char * gc_min_heap = NULL;
+	bool gc_compact = false;
+	bool gc_stats = false;
+	for (int i = 1; i < argc; i++) {
+		if (match_option("--gc-growth", argc, argv, &i, &gc_growth) ||
+			match_option("--gc-min-heap", argc, argv, &i, &gc_min_heap)) {
+			continue;
+		}
+		if (strcmp(argv[i], "--gc-compact") == 0) {
+			gc_compact = true;
+			continue;
+		}
+		if (strcmp(argv[i], "--gc-stats") == 0) {
+			gc_stats = true;
+			continue;
+		}
+		if (argv[i][0] == '-' && argv[i][1] == '-') {
+			fatal("Unknown option '%s'", argv[i]);
+		}
+		if (path) {
+			fatal("Provide one source file");
+		}
+		path = argv[i];
+	}
+	if (!path) {
 		fatal("Provide one source file");
 	}
 
-	Files::init(argv[1]);
+	Files::init(path);
 	Global_Alloc::init();
 	Intern::init();
+	Shapes::init();
 	GC::init();
+	// These take precedence over the environment variables GC::init()
+	// reads
+	if (gc_growth) {
+		GC::set_growth(gc_growth, "--gc-growth");
+	}
+	if (gc_min_heap) {
+		GC::set_min_heap(gc_min_heap, "--gc-min-heap");
+	}
+	if (gc_compact) {
+		GC::compaction = true;
+	}
+	if (gc_stats) {
+		GC::report_stats = true;
+	}
 	Builtins::init();
+	Constants::init();
 	Assoc_Allocator::init();
 	
-	work_from_source(argv[1]);
+	work_from_source(path);
 
 	Assoc_Allocator::destroy();
+	Constants::destroy();
 	Builtins::destroy();
 	GC::destroy();
+	Shapes::destroy();
 	Intern::destroy();
 	Global_Alloc::destroy();
 	Files::destroy();
@@ -78,7 +78,8 @@ Expr * Parser::parse_atom()
 	} break;
 	case TOKEN_SYMBOL: {
 		auto atom = create_expr(EXPR_VARIABLE);
-		atom->variable = peek.values.symbol;
+		atom->variable.name = peek.values.symbol;
+		atom->variable.address = Local_Address::global();
 		advance();
 		return atom;
 	} break;
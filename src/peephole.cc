@@ -0,0 +1,94 @@
+/* PEEPHOLE OPTIMIZER
+ *
+ * Runs over a finished block of bytecode and rewrites it in place.
+ * Right now this does two things:
+ *
+ * 1. Fuses `LOAD_CONST <symbol>` with the instruction that consumes
+ *    the symbol (RESOLVE_BINDING, CREATE_BINDING, etc.) into a single
+ *    superinstruction carrying the symbol as its argument.
+ * 2. Drops NOPs, which only exist to give jumps something to land on.
+ *
+ * Because instructions get removed, every jump target is remapped
+ * afterwards. A pair is never fused if something jumps into the
+ * middle of it.
+ */
+
+namespace Peephole {
+	bool is_jump(BC_Kind kind)
+	{
+		return
+			kind == BC_JUMP ||
+			kind == BC_POP_JUMP;
+	}
+	// Returns the superinstruction for `LOAD_CONST <symbol>; kind`, or
+	// BC_NOP if there isn't one
+	BC_Kind fused_kind(BC_Kind kind)
+	{
+		switch (kind) {
+		case BC_RESOLVE_BINDING:
+			return BC_RESOLVE_SYM;
+		case BC_CREATE_BINDING:
+			return BC_LET_SYM;
+		case BC_UPDATE_BINDING:
+			return BC_SET_SYM;
+		case BC_RESOLVE_FIELD:
+			return BC_GET_FIELD_SYM;
+		case BC_UPDATE_FIELD:
+			return BC_SET_FIELD_SYM;
+		default:
+			return BC_NOP;
+		}
+	}
+	// Returns the new length of the block
+	size_t optimize(BC * code, size_t length)
+	{
+		bool * is_target = (bool*) calloc(length, sizeof(bool));
+		int * new_index = (int*) malloc(sizeof(int) * length);
+		defer {
+			free(is_target);
+			free(new_index);
+		};
+		for (int i = 0; i < length; i++) {
+			if (is_jump(code[i].kind)) {
+				assert(code[i].arg.integer < length);
+				is_target[code[i].arg.integer] = true;
+			}
+		}
+
+		size_t out = 0;
+		for (int i = 0; i < length; i++) {
+			BC bc = code[i];
+			new_index[i] = out;
+			if (bc.kind == BC_NOP) {
+				// Anything jumping here lands on whatever comes next
+				continue;
+			}
+			if (bc.kind == BC_LOAD_CONST &&
+				bc.arg.value.is(TYPE_SYMBOL) &&
+				i + 1 < length &&
+				!is_target[i + 1]) {
+				BC_Kind fused = fused_kind(code[i + 1].kind);
+				if (fused != BC_NOP) {
+					// Errors are reported against the consumer, so
+					// keep its assoc
+					auto assoc = code[i + 1].assoc;
+					if (fused == BC_GET_FIELD_SYM || fused == BC_SET_FIELD_SYM) {
+						code[out++] = BC::create_field(fused, bc.arg.value.get_symbol(), assoc);
+					} else {
+						code[out++] = BC::create(fused, bc.arg.value, assoc);
+					}
+					new_index[++i] = out - 1;
+					continue;
+				}
+			}
+			code[out++] = bc;
+		}
+
+		for (int i = 0; i < out; i++) {
+			if (is_jump(code[i].kind)) {
+				code[i].arg.integer = new_index[code[i].arg.integer];
+			}
+		}
+		return out;
+	}
+}
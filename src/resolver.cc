@@ -0,0 +1,329 @@
+/* RESOLVER
+ *
+ * Sits between the parser and the compiler. Walks each statement's
+ * syntax tree and works out, for every local variable and parameter,
+ * which environment it will live in at runtime and which slot of
+ * that environment it occupies. The compiler then emits
+ * LOAD_LOCAL/STORE_LOCAL (or LOAD_FRAME/STORE_FRAME, see below) with
+ * those coordinates instead of searching for the name.
+ *
+ * A name declared with `let` becomes visible to the rest of its scope
+ * once its initializer has run, but lambdas see every name in their
+ * enclosing scopes regardless of order, since they might not be
+ * called until later (this is what makes local recursive functions
+ * work). If one is called too early, it finds the slot still unset
+ * and LOAD_LOCAL reports an error.
+ *
+ * Every statement is walked twice. The first pass only looks for
+ * scopes whose bindings are referenced from inside a lambda, and
+ * flags them as captured. On the second pass, captured scopes get an
+ * environment of their own (so that every entry into the scope makes
+ * fresh bindings for closures to hold onto), while the rest borrow
+ * slots from the enclosing frame and cost nothing to enter. Sibling
+ * scopes share the same frame slots.
+ *
+ * Lambda frames work the same way: unless something closes over
+ * them, their slots live directly on the VM stack. Parameters are
+ * given slots in reverse, matching the order arguments are pushed in,
+ * so that the arguments become the frame's first slots in place.
+ *
+ * Top-level names aren't touched -- they stay in the named global
+ * environment so that they can be exported and imported.
+ */
+
+struct Resolver_Scope {
+	List<Symbol> names;
+	// How many of `names` have finished being declared
+	size_t visible;
+	int function_level;
+	// Frames are lambda bodies and the file itself. The file always
+	// has an environment; everything else only gets one if it's
+	// captured.
+	bool is_frame;
+	bool materialized;
+	bool * captured;
+	// Where `names` start within the environment that holds them
+	int base;
+	// For frames: the next free slot, and how many we've needed
+	int top;
+	int slot_count;
+};
+
+struct Resolver {
+	List<Resolver_Scope> scopes;
+	int function_level;
+	bool analyzing;
+	// How many top-level `let`s there are of each global, and whether
+	// there's a `set` of it, so far, for File_Constants
+	Symbol_Table<int> global_lets;
+	Symbol_Table<bool> global_sets;
+	void init()
+	{
+		global_lets.alloc(0);
+		global_sets.alloc(false);
+		scopes.alloc();
+		function_level = 0;
+		// The file itself is the outermost frame
+		push_scope(true, NULL);
+	}
+	void destroy()
+	{
+		pop_scope();
+		assert(scopes.size == 0);
+		scopes.dealloc();
+		global_lets.dealloc();
+		global_sets.dealloc();
+	}
+	// Slots needed by the file's own frame
+	size_t file_slot_count()
+	{
+		return scopes[0].slot_count;
+	}
+	Resolver_Scope * innermost()
+	{
+		assert(scopes.size > 0);
+		return &scopes[scopes.size - 1];
+	}
+	int frame_of(int index)
+	{
+		while (!scopes[index].is_frame) {
+			index--;
+		}
+		return index;
+	}
+	void push_scope(bool is_frame, bool * captured)
+	{
+		Resolver_Scope scope;
+		scope.names.alloc();
+		scope.visible = 0;
+		scope.function_level = function_level;
+		scope.is_frame = is_frame;
+		scope.captured = captured;
+		if (captured && analyzing) {
+			*captured = false;
+		}
+		scope.materialized = captured ? *captured : true;
+		scope.base = 0;
+		scope.top = 0;
+		scope.slot_count = 0;
+		scopes.push(scope);
+	}
+	// Called once every name in the innermost scope is declared, to
+	// give them somewhere to live
+	void place_names()
+	{
+		auto scope = innermost();
+		if (scope->materialized) {
+			scope->top = scope->names.size;
+			scope->slot_count = scope->names.size;
+			return;
+		}
+		auto frame = &scopes[frame_of(scopes.size - 1)];
+		scope->base = frame->top;
+		frame->top += scope->names.size;
+		if (frame->top > frame->slot_count) {
+			frame->slot_count = frame->top;
+		}
+	}
+	size_t pop_scope()
+	{
+		auto scope = scopes.pop();
+		size_t slot_count = scope.slot_count;
+		if (!scope.materialized && !scope.is_frame) {
+			// Let sibling scopes reuse our slots (a frame's slots are
+			// its own, not borrowed from the frame around it)
+			scopes[frame_of(scopes.size - 1)].top = scope.base;
+		}
+		scope.names.dealloc();
+		return slot_count;
+	}
+	int declare(Symbol name, Assoc_Ptr assoc)
+	{
+		auto scope = innermost();
+		for (int i = 0; i < scope->names.size; i++) {
+			if (scope->names[i] == name) {
+				fatal_assoc(assoc, "Can't create new variable '%s' -- already bound in this scope!",
+							name);
+			}
+		}
+		scope->names.push(name);
+		return scope->names.size - 1;
+	}
+	Local_Address address_of(int index, int name_index)
+	{
+		auto scope = &scopes[index];
+		int home = scope->materialized ? index : frame_of(index);
+		int slot = scope->base + name_index;
+		if (!scopes[home].materialized) {
+			// Only code in the frame's own function can get here --
+			// anything else would have captured it
+			assert(analyzing || scopes[home].function_level == function_level);
+			return (Local_Address) { ADDRESS_FRAME, 0, slot };
+		}
+		int depth = 0;
+		for (int i = home + 1; i < scopes.size; i++) {
+			if (scopes[i].materialized) {
+				depth++;
+			}
+		}
+		return (Local_Address) { ADDRESS_ENVIRONMENT, depth, slot };
+	}
+	Local_Address lookup(Symbol name)
+	{
+		for (int i = scopes.size - 1; i >= 0; i--) {
+			auto scope = &scopes[i];
+			size_t searchable = scope->visible;
+			if (scope->function_level < function_level) {
+				searchable = scope->names.size;
+			}
+			for (int j = 0; j < searchable; j++) {
+				if (scope->names[j] != name) {
+					continue;
+				}
+				if (analyzing && scope->function_level < function_level && scope->captured) {
+					*scope->captured = true;
+				}
+				return address_of(i, j);
+			}
+		}
+		return Local_Address::global();
+	}
+	void resolve(Stmt * stmt)
+	{
+		analyzing = true;
+		resolve_stmt(stmt);
+		analyzing = false;
+		resolve_stmt(stmt);
+	}
+	void resolve_expr(Expr * expr)
+	{
+		switch (expr->kind) {
+		case EXPR_NOTHING:
+		case EXPR_INTEGER:
+		case EXPR_STRING:
+		case EXPR_THIS:
+			break;
+		case EXPR_VARIABLE:
+			expr->variable.address = lookup(expr->variable.name);
+			break;
+		case EXPR_UNARY:
+			resolve_expr(expr->unary.expr);
+			break;
+		case EXPR_BINARY:
+			resolve_expr(expr->binary.left);
+			resolve_expr(expr->binary.right);
+			break;
+		case EXPR_SCOPE: {
+			auto body = expr->scope.body;
+			push_scope(false, &expr->scope.captured);
+			// Declare everything up front so that lambdas can see
+			// names bound later on in the scope
+			for (int i = 0; i < body.size; i++) {
+				if (body[i]->kind == STMT_LET) {
+					declare(body[i]->let.left, body[i]->assoc);
+				}
+			}
+			place_names();
+			for (int i = 0; i < body.size; i++) {
+				resolve_stmt(body[i]);
+			}
+			if (expr->scope.terminator) {
+				resolve_expr(expr->scope.terminator);
+			}
+			expr->scope.slot_count = pop_scope();
+		} break;
+		case EXPR_LAMBDA: {
+			auto params = expr->lambda.parameters;
+			function_level++;
+			push_scope(true, &expr->lambda.captured);
+			for (int i = params.size - 1; i >= 0; i--) {
+				declare(params[i], expr->assoc);
+			}
+			innermost()->visible = params.size;
+			place_names();
+			resolve_expr(expr->lambda.body);
+			expr->lambda.slot_count = pop_scope();
+			function_level--;
+		} break;
+		case EXPR_FUNCALL: {
+			resolve_expr(expr->funcall.func);
+			auto args = expr->funcall.args;
+			for (int i = 0; i < args.size; i++) {
+				resolve_expr(args[i]);
+			}
+			auto flags = expr->funcall.flags;
+			for (int i = 0; i < flags.size; i++) {
+				resolve_expr(flags[i].expr);
+			}
+		} break;
+		case EXPR_IF: {
+			auto _if = expr->if_expr;
+			for (int i = 0; i < _if.conditions.size; i++) {
+				resolve_expr(_if.conditions[i]);
+				resolve_expr(_if.expressions[i]);
+			}
+			if (_if.else_expr) {
+				resolve_expr(_if.else_expr);
+			}
+		} break;
+		case EXPR_DIRECTIVE:
+			// Directive arguments are compile-time symbols, not
+			// variables
+			break;
+		case EXPR_FIELD:
+			resolve_expr(expr->field.left);
+			break;
+		case EXPR_LOOP:
+			resolve_expr(expr->loop.body);
+			break;
+		case EXPR_ON: {
+			// The flag gets a little scope of its own
+			push_scope(false, &expr->on.captured);
+			declare(expr->on.to_bind, expr->assoc);
+			innermost()->visible = 1;
+			place_names();
+			expr->on.address = lookup(expr->on.to_bind);
+			resolve_expr(expr->on.body);
+			pop_scope();
+		} break;
+		}
+	}
+	void resolve_stmt(Stmt * stmt)
+	{
+		switch (stmt->kind) {
+		case STMT_LET:
+			resolve_expr(stmt->let.right);
+			if (scopes.size == 1) {
+				stmt->let.address = Local_Address::global();
+				if (!analyzing) {
+					global_lets.set(stmt->let.left, global_lets.get(stmt->let.left) + 1);
+				}
+			} else {
+				// Already declared when we entered the scope; it just
+				// becomes visible now
+				auto scope = innermost();
+				assert(scope->names[scope->visible] == stmt->let.left);
+				stmt->let.address = address_of(scopes.size - 1, scope->visible++);
+			}
+			break;
+		case STMT_SET:
+			resolve_expr(stmt->set.right);
+			resolve_expr(stmt->set.left);
+			if (!analyzing &&
+				stmt->set.left->kind == EXPR_VARIABLE &&
+				!stmt->set.left->variable.address.is_local()) {
+				global_sets.set(stmt->set.left->variable.name, true);
+			}
+			break;
+		case STMT_RETURN:
+			resolve_expr(stmt->_return.expr);
+			break;
+		case STMT_EXPR:
+			resolve_expr(stmt->expr);
+			break;
+		case STMT_BREAK:
+			resolve_expr(stmt->_break);
+			break;
+		}
+	}
+};
@@ -24,3 +24,26 @@ char * itoa(int integer)
 
 bool int_comparator(int a, int b) { return a == b; }
 
+
+// Scrambles the bits of a word, so that keys which only differ in a
+// few bits (consecutive integers, neighbouring pointers) spread out
+uint64_t hash_word(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// FNV-1a
+uint64_t hash_bytes(const char * bytes, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
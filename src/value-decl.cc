@@ -7,6 +7,8 @@ enum Type {
 	TYPE_FUNCTION,
 	TYPE_CONSTRUCTOR,
 	TYPE_OBJECT,
+	TYPE_ARRAY,
+	TYPE_DICT,
 	TYPE_FILE_UNIT,
 };
 
@@ -14,9 +16,115 @@ struct Builtin;
 struct String;
 struct Function;
 struct Constructor;
+struct Shape;
 struct Object;
+struct Array;
+struct Dict;
 struct File_Unit;
 
+/* VALUES
+ *
+ * There are two representations of Value, chosen with COMPACT_VALUES.
+ * Either way, everything outside this file should go through
+ * raise/is/get_* rather than poking at the bits.
+ *
+ *  - The plain one is a Type alongside a union, which comes to 16
+ *    bytes once it's padded.
+ *  - The compact one is a single 8-byte word. The Type lives in the
+ *    top 16 bits and the payload in the bottom 48, which is enough
+ *    for any user-space pointer on x86-64 and aarch64. (Tagging the
+ *    low bits instead would take four of them, which GC cells could
+ *    spare, but symbols sit in the intern arena only 4-byte aligned.)
+ */
+
+#if COMPACT_VALUES
+
+static_assert(sizeof(void*) == 8, "COMPACT_VALUES needs 64-bit pointers");
+
+struct Value {
+	uint64_t bits;
+
+	static constexpr int tag_shift = 48;
+	static constexpr uint64_t payload_mask = (((uint64_t) 1) << tag_shift) - 1;
+
+	static Value with_payload(Type type, uint64_t payload)
+	{
+		assert((payload & ~payload_mask) == 0);
+		Value v;
+		v.bits = (((uint64_t) type) << tag_shift) | payload;
+		return v;
+	}
+	template <typename T>
+	static Value with_pointer(Type type, T * ptr)
+	{
+		return with_payload(type, (uint64_t) (uintptr_t) ptr);
+	}
+	template <typename T>
+	T * pointer()
+	{
+		return (T*) (uintptr_t) (bits & payload_mask);
+	}
+	Type get_type()
+	{
+		return (Type) (bits >> tag_shift);
+	}
+	int get_integer()
+	{
+		return (int) (uint32_t) bits;
+	}
+	Symbol get_symbol()            { return pointer<const char>(); }
+	Builtin * get_builtin()        { return pointer<Builtin>(); }
+	String * get_string()          { return pointer<String>(); }
+	Function * get_function()      { return pointer<Function>(); }
+	Constructor * get_constructor() { return pointer<Constructor>(); }
+	Object * get_object()          { return pointer<Object>(); }
+	Array * get_array()            { return pointer<Array>(); }
+	Dict * get_dict()              { return pointer<Dict>(); }
+	File_Unit * get_file_unit()    { return pointer<File_Unit>(); }
+
+	static Value nothing()
+	{
+		return with_payload(TYPE_NOTHING, 0);
+	}
+	// What a local holds until its `let` has run. It's never loaded
+	// out of a slot, so nothing else has to know about it.
+	static Value unset()
+	{
+		return with_payload(TYPE_NOTHING, 1);
+	}
+	bool is_unset()
+	{
+		return bits == unset().bits;
+	}
+	static Value raise(int integer)
+	{
+		return with_payload(TYPE_INTEGER, (uint32_t) integer);
+	}
+	static Value raise(Symbol symbol)           { return with_pointer(TYPE_SYMBOL, symbol); }
+	static Value raise(Builtin * builtin)       { return with_pointer(TYPE_BUILTIN, builtin); }
+	static Value raise(String * string)         { return with_pointer(TYPE_STRING, string); }
+	static Value raise(Function * function)     { return with_pointer(TYPE_FUNCTION, function); }
+	static Value raise(Constructor * ctor)      { return with_pointer(TYPE_CONSTRUCTOR, ctor); }
+	static Value raise(Object * object)         { return with_pointer(TYPE_OBJECT, object); }
+	static Value raise(Array * array)           { return with_pointer(TYPE_ARRAY, array); }
+	static Value raise(Dict * dict)             { return with_pointer(TYPE_DICT, dict); }
+	static Value raise(File_Unit * unit)        { return with_pointer(TYPE_FILE_UNIT, unit); }
+
+	// A single read, for when another thread might be writing
+	Value load()
+	{
+		Value v;
+		v.bits = __atomic_load_n(&bits, __ATOMIC_RELAXED);
+		return v;
+	}
+	// A single write, for when another thread might be reading
+	void store(Value value)
+	{
+		__atomic_store_n(&bits, value.bits, __ATOMIC_RELAXED);
+	}
+
+#else
+
 struct Value {
 	Type type;
 	union {
@@ -27,16 +135,36 @@ struct Value {
 		Function * ref_function;
 		Constructor * ref_constructor;
 		Object * ref_object;
+		Array * ref_array;
+		Dict * ref_dict;
 		File_Unit * ref_file_unit;
 	};
-	static Value create(Type type)
-	{
-		return (Value) { type };
-	}
+	Type get_type()                 { return type; }
+	int get_integer()               { return integer; }
+	Symbol get_symbol()             { return symbol; }
+	Builtin * get_builtin()         { return builtin; }
+	String * get_string()           { return ref_string; }
+	Function * get_function()       { return ref_function; }
+	Constructor * get_constructor() { return ref_constructor; }
+	Object * get_object()           { return ref_object; }
+	Array * get_array()             { return ref_array; }
+	Dict * get_dict()               { return ref_dict; }
+	File_Unit * get_file_unit()     { return ref_file_unit; }
+
 	static Value nothing()
 	{
 		return (Value) { TYPE_NOTHING };
 	}
+	static Value unset()
+	{
+		Value v = { TYPE_NOTHING };
+		v.integer = 1;
+		return v;
+	}
+	bool is_unset()
+	{
+		return type == TYPE_NOTHING && integer == 1;
+	}
 	static Value raise(int integer)
 	{
 		Value v = { TYPE_INTEGER };
@@ -49,6 +177,68 @@ struct Value {
 		v.symbol = symbol;
 		return v;
 	}
+	static Value raise(Builtin * builtin)
+	{
+		Value v = { TYPE_BUILTIN };
+		v.builtin = builtin;
+		return v;
+	}
+	static Value raise(String * string)
+	{
+		Value v = { TYPE_STRING };
+		v.ref_string = string;
+		return v;
+	}
+	static Value raise(Function * function)
+	{
+		Value v = { TYPE_FUNCTION };
+		v.ref_function = function;
+		return v;
+	}
+	static Value raise(Constructor * ctor)
+	{
+		Value v = { TYPE_CONSTRUCTOR };
+		v.ref_constructor = ctor;
+		return v;
+	}
+	static Value raise(Object * object)
+	{
+		Value v = { TYPE_OBJECT };
+		v.ref_object = object;
+		return v;
+	}
+	static Value raise(Array * array)
+	{
+		Value v = { TYPE_ARRAY };
+		v.ref_array = array;
+		return v;
+	}
+	static Value raise(Dict * dict)
+	{
+		Value v = { TYPE_DICT };
+		v.ref_dict = dict;
+		return v;
+	}
+	static Value raise(File_Unit * unit)
+	{
+		Value v = { TYPE_FILE_UNIT };
+		v.ref_file_unit = unit;
+		return v;
+	}
+
+	// Values this size can't be read or written in one go, which is
+	// why concurrent marking needs COMPACT_VALUES
+	Value load()
+	{
+		return *this;
+	}
+	void store(Value value)
+	{
+		*this = value;
+	}
+
+#endif
+
 	static Value raise_bool(bool b) // Can't be an overload because
 									// C++ is stupid
 	{
@@ -60,11 +250,11 @@ struct Value {
 	}
 	bool truthy()
 	{
-		return this->type != TYPE_NOTHING;
+		return !is(TYPE_NOTHING);
 	}
 	bool is(Type type)
 	{
-		return this->type == type;
+		return get_type() == type;
 	}
 	void assert_is(Type type)
 	{
@@ -72,7 +262,7 @@ struct Value {
 	}
 	bool same_type(Value other)
 	{
-		return type == other.type;
+		return get_type() == other.get_type();
 	}
 	char * to_string();
 	void gc_mark();
@@ -89,3 +279,7 @@ struct Value {
 	static bool _and(Value a, Value b, Assoc_Ptr assoc = -1);
 	static bool _or(Value a, Value b, Assoc_Ptr assoc = -1);
 };
+
+#if COMPACT_VALUES
+static_assert(sizeof(Value) == sizeof(uint64_t), "Compact values should fit in a word");
+#endif
@@ -1,7 +1,15 @@
+/* Builtins are handed their arguments as a view straight into the VM
+ * stack. Arguments are pushed last-first, so args[count - 1] is the
+ * first one (see the ARG macro in builtins.cc).
+ */
 struct Builtin {
 	Symbol name;
-	size_t arg_count;
-	Value(*funcptr)(Value *);
+	int min_args;
+	// Negative for no upper limit
+	int max_args;
+	Value(*funcptr)(Value * args, size_t count);
+	// An instruction that does the same job, or BC_NOP
+	BC_Kind intrinsic;
 };
 
 struct String {
@@ -9,41 +17,351 @@ struct String {
 	size_t length;
 	void gc_mark()
 	{
-		GC::mark_opaque(string);
+		GC::trace_leaf(&string);
 	}
 };
 
 struct Function {
-	Symbol * parameters;
 	size_t parameter_count;
 	size_t block_reference;
 	Environment * closure;
+	// The named environment of the file this function was defined in
+	Environment * globals;
 	void gc_mark()
 	{
-		GC::mark_opaque(parameters);
-		if (!GC::is_marked_opaque(closure)) {
-			GC::mark_opaque(closure);
-			closure->gc_mark();
+		GC::trace(&globals);
+		GC::trace(&closure);
+	}
+};
+
+/* A shape is the list of fields an object has, in the order they're
+ * stored, by symbol ID. Objects can't gain or lose fields, so an
+ * object's shape never changes, and field lookups can be cached per
+ * instruction against it (see BC_GET_FIELD_SYM).
+ *
+ * Constructors with the same fields share a shape. Shapes live until
+ * the program exits and never move, so a cached shape can't come to
+ * mean something else.
+ */
+struct Shape {
+	size_t field_count;
+	Symbol_ID fields[];
+	// Returns -1 if there's no such field
+	int index_of(Symbol symbol)
+	{
+		auto id = Intern::id_of(symbol);
+		for (int i = 0; i < field_count; i++) {
+			if (fields[i] == id) {
+				return i;
+			}
 		}
+		return -1;
 	}
 };
 
+namespace Shapes {
+	List<Shape*> shapes;
+	void init()
+	{
+		shapes.alloc();
+	}
+	void destroy()
+	{
+		for (int i = 0; i < shapes.size; i++) {
+			free(shapes[i]);
+		}
+		shapes.dealloc();
+	}
+	Shape * of(Symbol_ID * fields, size_t field_count)
+	{
+		for (int i = 0; i < shapes.size; i++) {
+			auto shape = shapes[i];
+			if (shape->field_count == field_count &&
+				memcmp(shape->fields, fields, sizeof(Symbol_ID) * field_count) == 0) {
+				return shape;
+			}
+		}
+		auto shape = (Shape*) malloc(sizeof(Shape) + sizeof(Symbol_ID) * field_count);
+		shape->field_count = field_count;
+		memcpy(shape->fields, fields, sizeof(Symbol_ID) * field_count);
+		shapes.push(shape);
+		return shape;
+	}
+}
+
 struct Constructor {
-	Symbol * fields;
-	size_t field_count;
+	Shape * shape;
 	void gc_mark()
 	{
-		GC::mark_opaque(fields);
 	}
 };
 
 struct Object {
-	GC_Map<Symbol, Value> fields;
+	Shape * shape;
+	Value fields[];
+	static Object * alloc(Shape * shape)
+	{
+		auto object = (Object*) GC::alloc(sizeof(Object) +
+										  sizeof(Value) * shape->field_count);
+		object->shape = shape;
+		for (int i = 0; i < shape->field_count; i++) {
+			object->fields[i] = Value::nothing();
+		}
+		return object;
+	}
 	void gc_mark()
 	{
-		fields.gc_mark();
-		for (int i = 0; i < fields.values.size; i++) {
-			fields.values[i].gc_mark();
+		for (int i = 0; i < shape->field_count; i++) {
+			fields[i].gc_mark();
+		}
+	}
+};
+
+/* Arrays keep their elements in one contiguous GC-allocated buffer,
+ * which is replaced with one twice the size when a push runs out of
+ * room. An array can be old by the time it's stored into, and its
+ * buffer can be younger than it is, so every store goes through the
+ * write barrier.
+ */
+struct Array {
+	GC_List<Value> elements;
+	static Array * alloc()
+	{
+		auto array = (Array*) GC::alloc(sizeof(Array));
+		array->elements.alloc();
+		return array;
+	}
+	size_t length()
+	{
+		return elements.size;
+	}
+	bool in_bounds(int index)
+	{
+		return index >= 0 && index < elements.size;
+	}
+	// Argument checks shared by the array_* builtins and the
+	// instructions that stand in for them, so that both fail the same
+	// way. Builtins have no source location to give.
+	static Array * checked(Value value, const char * builtin, Assoc_Ptr assoc = -1)
+	{
+		if (!value.is(TYPE_ARRAY)) {
+			fatal_assoc(assoc, "Builtin function %s() takes array", builtin);
+		}
+		return value.get_array();
+	}
+	int checked_index(Value index, Assoc_Ptr assoc = -1)
+	{
+		if (!index.is(TYPE_INTEGER)) {
+			fatal_assoc(assoc, "Array index must be an integer");
+		}
+		if (!in_bounds(index.get_integer())) {
+			fatal_assoc(assoc, "Array index %d out of bounds for length %d",
+						index.get_integer(), (int) length());
+		}
+		return index.get_integer();
+	}
+	Value get(int index)
+	{
+		assert(in_bounds(index));
+		return elements.arr[index];
+	}
+	void set(int index, Value value)
+	{
+		assert(in_bounds(index));
+		elements.arr[index].store(value);
+		GC::write_barrier(this);
+	}
+	void push(Value value)
+	{
+		elements.push(value);
+		GC::write_barrier(this);
+	}
+	void gc_mark()
+	{
+		elements.gc_mark_elements();
+	}
+};
+
+/* Dictionaries are hash tables with open addressing: an entry goes in
+ * the first free slot at or after the one its key hashes to. Removing
+ * an entry leaves a tombstone behind, so that looking up keys further
+ * along doesn't stop short, and tombstones are cleared out whenever
+ * the table is rebuilt.
+ *
+ * Keys can be integers, strings or symbols. Strings are hashed by
+ * their contents and symbols by ID, so nothing needs rehashing when
+ * the collector moves them, and keys come out in the same order from
+ * one run to the next. The table carries its own capacity, so that a marking thread
+ * that loads the table pointer always has the capacity that goes with
+ * it, even while the program is replacing the table.
+ */
+struct Dict_Entry {
+	// EMPTY, TOMBSTONE, or otherwise the hash of the key
+	uint64_t hash;
+	Value key;
+	Value value;
+};
+
+struct Dict_Table {
+	size_t capacity;
+	Dict_Entry entries[];
+};
+
+struct Dict {
+	static const uint64_t EMPTY = 0;
+	static const uint64_t TOMBSTONE = 1;
+	static const size_t INITIAL_CAPACITY = 8;
+	Dict_Table * table;
+	size_t count;
+	// Slots that aren't empty, including tombstones
+	size_t used;
+	static Dict * alloc()
+	{
+		auto dict = (Dict*) GC::alloc(sizeof(Dict));
+		dict->count = 0;
+		dict->used = 0;
+		dict->table = alloc_table(INITIAL_CAPACITY);
+		return dict;
+	}
+	static Dict_Table * alloc_table(size_t capacity)
+	{
+		auto table = (Dict_Table*) GC::alloc(sizeof(Dict_Table) +
+											 sizeof(Dict_Entry) * capacity);
+		table->capacity = capacity;
+		for (size_t i = 0; i < capacity; i++) {
+			table->entries[i].hash = EMPTY;
+			table->entries[i].key = Value::nothing();
+			table->entries[i].value = Value::nothing();
+		}
+		return table;
+	}
+	static bool valid_key(Value key)
+	{
+		return key.is(TYPE_INTEGER) || key.is(TYPE_STRING) || key.is(TYPE_SYMBOL);
+	}
+	static uint64_t hash(Value key)
+	{
+		uint64_t hash;
+		switch (key.get_type()) {
+		case TYPE_INTEGER:
+			hash = hash_word((uint32_t) key.get_integer());
+			break;
+		case TYPE_SYMBOL:
+			hash = hash_word(Intern::id_of(key.get_symbol()));
+			break;
+		case TYPE_STRING:
+			hash = hash_bytes(key.get_string()->string, key.get_string()->length);
+			break;
+		default:
+			assert(false);
+		}
+		// Keep clear of the values that mark empty slots and tombstones
+		return hash <= TOMBSTONE ? hash + 2 : hash;
+	}
+	// Returns the entry for `key`, or NULL
+	Dict_Entry * find(Value key)
+	{
+		uint64_t key_hash = hash(key);
+		size_t mask = table->capacity - 1;
+		for (size_t i = key_hash & mask;; i = (i + 1) & mask) {
+			auto entry = &table->entries[i];
+			if (entry->hash == EMPTY) {
+				return NULL;
+			}
+			if (entry->hash == key_hash && Value::equal(entry->key, key)) {
+				return entry;
+			}
+		}
+	}
+	bool lookup(Value key, Value * value)
+	{
+		auto entry = find(key);
+		if (!entry) {
+			return false;
+		}
+		*value = entry->value;
+		return true;
+	}
+	void put(Value key, Value value)
+	{
+		// Keep the table at most three quarters full, so that there's
+		// always an empty slot to stop a search
+		if ((used + 1) * 4 > table->capacity * 3) {
+			size_t capacity = INITIAL_CAPACITY;
+			while (capacity < (count + 1) * 2) {
+				capacity *= 2;
+			}
+			rebuild(capacity);
+		}
+		uint64_t key_hash = hash(key);
+		size_t mask = table->capacity - 1;
+		Dict_Entry * free_slot = NULL;
+		for (size_t i = key_hash & mask;; i = (i + 1) & mask) {
+			auto entry = &table->entries[i];
+			if (entry->hash == EMPTY) {
+				if (!free_slot) {
+					free_slot = entry;
+					used++;
+				}
+				break;
+			}
+			if (entry->hash == TOMBSTONE) {
+				if (!free_slot) {
+					free_slot = entry;
+				}
+				continue;
+			}
+			if (entry->hash == key_hash && Value::equal(entry->key, key)) {
+				entry->value.store(value);
+				GC::write_barrier(this);
+				return;
+			}
+		}
+		free_slot->key.store(key);
+		free_slot->value.store(value);
+		free_slot->hash = key_hash;
+		count++;
+		GC::write_barrier(this);
+	}
+	bool remove(Value key)
+	{
+		auto entry = find(key);
+		if (!entry) {
+			return false;
+		}
+		entry->hash = TOMBSTONE;
+		entry->key.store(Value::nothing());
+		entry->value.store(Value::nothing());
+		count--;
+		return true;
+	}
+	void rebuild(size_t capacity)
+	{
+		auto rebuilt = alloc_table(capacity);
+		size_t mask = capacity - 1;
+		for (size_t i = 0; i < table->capacity; i++) {
+			auto entry = &table->entries[i];
+			if (entry->hash <= TOMBSTONE) {
+				continue;
+			}
+			size_t j = entry->hash & mask;
+			while (rebuilt->entries[j].hash != EMPTY) {
+				j = (j + 1) & mask;
+			}
+			rebuilt->entries[j] = *entry;
+		}
+		// Filled in before it's published, for marking threads
+		__atomic_store_n(&table, rebuilt, __ATOMIC_RELEASE);
+		used = count;
+		GC::write_barrier(this);
+	}
+	void gc_mark()
+	{
+		GC::trace_leaf(&table);
+		auto table = __atomic_load_n(&this->table, __ATOMIC_ACQUIRE);
+		for (size_t i = 0; i < table->capacity; i++) {
+			table->entries[i].key.gc_mark();
+			table->entries[i].value.gc_mark();
 		}
 	}
 };
@@ -54,17 +372,18 @@ struct File_Unit {
 
 char * Value::to_string()
 {
-	switch (type) {
+	switch (get_type()) {
 	case TYPE_NOTHING:
 		return strdup("nothing");
 	case TYPE_INTEGER:
-		return itoa(integer);
+		return itoa(get_integer());
 	case TYPE_SYMBOL:
-		return strdup(symbol);
+		return strdup(get_symbol());
 	case TYPE_STRING: {
-		char * s = (char*) malloc(sizeof(char) * (ref_string->length + 1));
-		strncpy(s, ref_string->string, ref_string->length);
-		s[ref_string->length] = '\0';
+		auto string = get_string();
+		char * s = (char*) malloc(sizeof(char) * (string->length + 1));
+		strncpy(s, string->string, string->length);
+		s[string->length] = '\0';
 		return s;
 	};
 	case TYPE_FUNCTION:
@@ -75,6 +394,10 @@ char * Value::to_string()
 		return strdup("@[constructor]");
 	case TYPE_OBJECT:
 		return strdup("@[object]");
+	case TYPE_ARRAY:
+		return strdup("@[array]");
+	case TYPE_DICT:
+		return strdup("@[dict]");
 	case TYPE_FILE_UNIT:
 		assert(false);
 	}
@@ -83,34 +406,58 @@ char * Value::to_string()
 
 void Value::gc_mark()
 {
-	switch (type) {
+	// Marking might be happening on another thread, with the program
+	// changing this value as we go (through store()), so it's read
+	// just once and only written back when a collection has moved what
+	// it points to
+	Value value = load();
+	switch (value.get_type()) {
 	case TYPE_NOTHING:
 		break;
 	case TYPE_INTEGER:
 		break;
 	case TYPE_SYMBOL:
 		break;
-	case TYPE_STRING:
-		GC::mark_opaque(ref_string);
-		ref_string->gc_mark();
-		break;
-	case TYPE_FUNCTION:
-		GC::mark_opaque(ref_function);
-		ref_function->gc_mark();
-		break;
+	case TYPE_STRING: {
+		auto string = value.get_string();
+		GC::trace(&string);
+		value = Value::raise(string);
+	} break;
+	case TYPE_FUNCTION: {
+		auto function = value.get_function();
+		GC::trace(&function);
+		value = Value::raise(function);
+	} break;
 	case TYPE_BUILTIN:
 		break;
-	case TYPE_CONSTRUCTOR:
-		GC::mark_opaque(ref_constructor);
-		ref_constructor->gc_mark();
-		break;
-	case TYPE_OBJECT:
-		GC::mark_opaque(ref_object);
-		ref_object->gc_mark();
-		break;
-	case TYPE_FILE_UNIT:
-		GC::mark_opaque(ref_file_unit);
-		break;
+	case TYPE_CONSTRUCTOR: {
+		auto constructor = value.get_constructor();
+		GC::trace(&constructor);
+		value = Value::raise(constructor);
+	} break;
+	case TYPE_OBJECT: {
+		auto object = value.get_object();
+		GC::trace(&object);
+		value = Value::raise(object);
+	} break;
+	case TYPE_ARRAY: {
+		auto array = value.get_array();
+		GC::trace(&array);
+		value = Value::raise(array);
+	} break;
+	case TYPE_DICT: {
+		auto dict = value.get_dict();
+		GC::trace(&dict);
+		value = Value::raise(dict);
+	} break;
+	case TYPE_FILE_UNIT: {
+		auto unit = value.get_file_unit();
+		GC::trace_leaf(&unit);
+		value = Value::raise(unit);
+	} break;
+	}
+	if (GC::moving()) {
+		store(value);
 	}
 }
 
@@ -124,9 +471,9 @@ static void validate_same_type(Value a, Value b, Assoc_Ptr assoc = -1)
 Value Value::add(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return Value::raise(a.integer + b.integer);
+		return Value::raise(a.get_integer() + b.get_integer());
 	default:
 		fatal_assoc(assoc, "+ not valid for type");
 	}
@@ -136,9 +483,9 @@ Value Value::add(Value a, Value b, Assoc_Ptr assoc)
 Value Value::subtract(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return Value::raise(a.integer - b.integer);
+		return Value::raise(a.get_integer() - b.get_integer());
 	default:
 		fatal_assoc(assoc, "- not valid for type");
 	}
@@ -148,9 +495,9 @@ Value Value::subtract(Value a, Value b, Assoc_Ptr assoc)
 Value Value::multiply(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return Value::raise(a.integer * b.integer);
+		return Value::raise(a.get_integer() * b.get_integer());
 	default:
 		fatal_assoc(assoc, "* not valid for type");
 	}
@@ -160,9 +507,9 @@ Value Value::multiply(Value a, Value b, Assoc_Ptr assoc)
 Value Value::divide(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return Value::raise(a.integer / b.integer);
+		return Value::raise(a.get_integer() / b.get_integer());
 	default:
 		fatal_assoc(assoc, "/ not valid for type");
 	}
@@ -171,31 +518,35 @@ Value Value::divide(Value a, Value b, Assoc_Ptr assoc)
 
 bool Value::equal(Value a, Value b, Assoc_Ptr assoc)
 {
-	if (a.type != b.type) {
+	if (a.get_type() != b.get_type()) {
 		return false;
 	}
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_NOTHING:
 		return true;
 	case TYPE_INTEGER:
-		return a.integer == b.integer;
+		return a.get_integer() == b.get_integer();
 	case TYPE_SYMBOL:
-		return a.symbol == b.symbol;
+		return a.get_symbol() == b.get_symbol();
 	case TYPE_STRING:
-		if (a.ref_string->length != b.ref_string->length) {
+		if (a.get_string()->length != b.get_string()->length) {
 			return false;
 		}
-		return strncmp(a.ref_string->string,
-					   b.ref_string->string,
-					   a.ref_string->length);
+		return memcmp(a.get_string()->string,
+					  b.get_string()->string,
+					  a.get_string()->length) == 0;
 	case TYPE_FUNCTION:
-		return a.ref_function == b.ref_function;
+		return a.get_function() == b.get_function();
 	case TYPE_BUILTIN:
-		return a.builtin == b.builtin;
+		return a.get_builtin() == b.get_builtin();
 	case TYPE_CONSTRUCTOR:
-		return a.ref_constructor == b.ref_constructor;
+		return a.get_constructor() == b.get_constructor();
 	case TYPE_OBJECT:
-		return a.ref_object == b.ref_object;
+		return a.get_object() == b.get_object();
+	case TYPE_ARRAY:
+		return a.get_array() == b.get_array();
+	case TYPE_DICT:
+		return a.get_dict() == b.get_dict();
 	case TYPE_FILE_UNIT:
 		assert(false);
 	}
@@ -215,9 +566,9 @@ bool Value::_or(Value a, Value b, Assoc_Ptr assoc)
 bool Value::less_than(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return a.integer < b.integer;
+		return a.get_integer() < b.get_integer();
 	default:
 		fatal_assoc(assoc, "< not valid for type");
 	}
@@ -227,9 +578,9 @@ bool Value::less_than(Value a, Value b, Assoc_Ptr assoc)
 bool Value::greater_than(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return a.integer > b.integer;
+		return a.get_integer() > b.get_integer();
 	default:
 		fatal_assoc(assoc, "> not valid for type");
 	}
@@ -239,9 +590,9 @@ bool Value::greater_than(Value a, Value b, Assoc_Ptr assoc)
 bool Value::less_than_or_equal_to(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return a.integer <= b.integer;
+		return a.get_integer() <= b.get_integer();
 	default:
 		fatal_assoc(assoc, "<= not valid for type");
 	}
@@ -251,9 +602,9 @@ bool Value::less_than_or_equal_to(Value a, Value b, Assoc_Ptr assoc)
 bool Value::greater_than_or_equal_to(Value a, Value b, Assoc_Ptr assoc)
 {
 	validate_same_type(a, b, assoc);
-	switch (a.type) {
+	switch (a.get_type()) {
 	case TYPE_INTEGER:
-		return a.integer >= b.integer;
+		return a.get_integer() >= b.get_integer();
 	default:
 		fatal_assoc(assoc, ">= not valid for type");
 	}
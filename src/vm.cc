@@ -3,62 +3,51 @@ struct Call_Frame {
 	
 	Environment * environment;
 	size_t block_reference;
-
-	Environment * call_flags;
+	// The named environment of the file this frame's code came from
+	Environment * globals;
 	
 	BC * bytecode;
 	size_t bc_pointer;
 	size_t bc_length;
 
-	List<int> body_stack;
+	// Where this frame's slots start on the VM stack. Frames whose
+	// environment is closed over keep their slots in `environment`
+	// instead, and nothing lives above `base` but their temporaries.
+	size_t base;
+
 	/* A note on allocation:
-	 *  Call frames themselves are managed manually through
-	 *  malloc/free. However, some components need to be garbage
-	 *  collected. These are marked with the gc_mark function.
+	 *  Call frames live inline in the VM's call stack, and the
+	 *  environments they point to are garbage collected. These are
+	 *  traced (and updated, if they move) with the gc_mark function.
 	 */
-	static Call_Frame * alloc(Blocks * blocks, size_t block_reference,
-							  Function * origin, Environment * closure)
+	void init(Blocks * blocks, size_t block_reference, Function * origin,
+			  Environment * environment, Environment * globals, size_t base)
 	{
-		Call_Frame * frame = (Call_Frame*) malloc(sizeof(Call_Frame));
-		frame->origin = origin;
-		frame->environment = Environment::alloc();
-		frame->environment->next_env = closure;
-		frame->block_reference = block_reference;
-
-		frame->call_flags = Environment::alloc();
-	
-		frame->bytecode = blocks->retrieve_block(block_reference);
-		frame->bc_pointer = 0;
-		frame->bc_length = blocks->size_block(block_reference);
-
-		frame->body_stack.alloc();
-		return frame;
+		this->origin = origin;
+		this->environment = environment;
+		this->globals = globals;
+		this->block_reference = block_reference;
+		this->bytecode = blocks->retrieve_block(block_reference);
+		this->bc_pointer = 0;
+		this->bc_length = blocks->size_block(block_reference);
+		this->base = base;
 	}
 	void gc_mark()
 	{
 		if (origin) {
-			GC::mark_opaque(origin);
-			origin->gc_mark();
+			GC::trace(&origin);
 		}
-		// TODO(pixlark): Why do we check if this is marked opaque??
-		// The whole point is that we just do it regardless...
-		if (!GC::is_marked_opaque(environment)) {
-			GC::mark_opaque(environment);
-			environment->gc_mark();
+		if (environment) {
+			GC::trace(&environment);
 		}
-		if (!GC::is_marked_opaque(call_flags)) {
-			GC::mark_opaque(call_flags);
-			call_flags->gc_mark();
+		if (globals) {
+			GC::trace(&globals);
 		}
 	}
-	void destroy()
-	{
-		body_stack.dealloc();
-	}
 };
 
 enum VM_Response {
-	VM_OK,
+	VM_COLLECT,
 	VM_HALTED,
 	VM_SWITCH,
 };
@@ -73,9 +62,12 @@ struct VM {
 	Environment * export_scope;
 	List<Export> export_queue;
 	List<Value> stack;
-	List<Call_Frame*> call_stack;
+	List<Call_Frame> call_stack;
 	Assoc_Ptr current_assoc;
 	size_t block_reference_to_push;
+
+	static constexpr size_t initial_stack_capacity = 256;
+	static constexpr size_t initial_call_stack_capacity = 64;
 	
 	void init(Blocks * blocks, Environment * export_scope, size_t block_reference)
 	{
@@ -83,10 +75,18 @@ struct VM {
 		this->export_scope = export_scope;
 
 		export_queue.alloc();
+		// Neither of these ever shrink, so after the first few calls
+		// of any depth we stop touching the allocator at all
 		stack.alloc();
-		
+		stack.reserve(initial_stack_capacity);
 		call_stack.alloc();
-		call_stack.push(Call_Frame::alloc(blocks, block_reference, NULL, NULL));
+		call_stack.reserve(initial_call_stack_capacity);
+
+		// File units keep their globals in a named environment
+		auto env = Environment::alloc(blocks->slots_block(block_reference));
+		Call_Frame frame;
+		frame.init(blocks, block_reference, NULL, env, env, 0);
+		call_stack.push(frame);
 	}
 	void error(const char * fmt, ...) {
 		va_list args;
@@ -112,19 +112,21 @@ struct VM {
 	}
 	Value pop()
 	{
-		return stack.pop();
+		// Not List::pop, which would shrink the stack on its way down
+		assert(stack.size > 0);
+		return stack.arr[--stack.size];
 	}
 	int pop_integer()
 	{
 		auto val = pop();
 		val.assert_is(TYPE_INTEGER);
-		return val.integer;
+		return val.get_integer();
 	}
 	Symbol pop_symbol()
 	{
 		auto val = pop();
 		val.assert_is(TYPE_SYMBOL);
-		return val.symbol;
+		return val.get_symbol();
 	}
 	size_t top_offset()
 	{
@@ -132,26 +134,143 @@ struct VM {
 	}
 	void mark_reachable()
 	{
-		GC::mark_opaque(export_scope);
-		export_scope->gc_mark();
+		GC::trace(&export_scope);
 		for (int i = 0; i < call_stack.size; i++) {
-			call_stack[i]->gc_mark();
+			call_stack[i].gc_mark();
 		}
 		for (int i = 0; i < stack.size; i++) {
 			stack[i].gc_mark();
 		}
 	}
+	/* Arguments are sitting on top of the stack, last one deepest
+	 * (this is the order the Resolver gives parameters their slots
+	 * in). If the function's frame is never closed over, they simply
+	 * become its first slots and the rest are reserved above them;
+	 * otherwise they're moved into a fresh environment.
+	 */
+	void push_frame(Function * func, size_t arg_count)
+	{
+		size_t reference = func->block_reference;
+		size_t slot_count = blocks->slots_block(reference);
+		size_t base = stack.size - arg_count;
+		Environment * env;
+		if (blocks->frame_environment_block(reference)) {
+			env = Environment::alloc_slots(slot_count);
+			env->next_env = func->closure;
+			for (int i = 0; i < arg_count; i++) {
+				env->slots[i] = stack[base + i];
+			}
+			GC::write_barrier(env);
+			stack.size = base;
+		} else {
+			env = func->closure;
+			stack.reserve(base + slot_count);
+			for (size_t i = arg_count; i < slot_count; i++) {
+				stack.arr[stack.size++] = Value::nothing();
+			}
+		}
+		Call_Frame frame;
+		frame.init(blocks, reference, func, env, func->globals, base);
+		call_stack.push(frame);
+	}
+	// Builtins and constructors run right away without a frame of
+	// their own. Returns false if `func_val` is neither.
+	bool call_native(Value func_val, int passed_arg_count)
+	{
+		if (func_val.is(TYPE_BUILTIN)) {
+			auto builtin = func_val.get_builtin();
+			if (passed_arg_count < builtin->min_args ||
+				(builtin->max_args >= 0 && passed_arg_count > builtin->max_args)) {
+				if (builtin->min_args == builtin->max_args) {
+					error("Function takes %d arguments; was passed %d",
+						  builtin->min_args,
+						  passed_arg_count);
+				} else if (builtin->max_args < 0) {
+					error("Function takes at least %d arguments; was passed %d",
+						  builtin->min_args,
+						  passed_arg_count);
+				} else {
+					error("Function takes %d to %d arguments; was passed %d",
+						  builtin->min_args,
+						  builtin->max_args,
+						  passed_arg_count);
+				}
+			}
+			// The arguments are used in place and then dropped
+			Value * args = stack.arr + stack.size - passed_arg_count;
+			auto result = (builtin->funcptr)(args, passed_arg_count);
+			stack.size -= passed_arg_count;
+			push(result);
+			return true;
+		} else if (func_val.is(TYPE_CONSTRUCTOR)) {
+			auto shape = func_val.get_constructor()->shape;
+			if (passed_arg_count != shape->field_count) {
+				error("Constructor has %d fields; was passed %d",
+					  shape->field_count,
+					  passed_arg_count);
+			}
+
+			auto object = Object::alloc(shape);
+			for (int i = 0; i < shape->field_count; i++) {
+				object->fields[i] = pop();
+			}
+			// Objects too big for the nursery start out old
+			GC::write_barrier(object);
+
+			push(Value::raise(object));
+			return true;
+		}
+		return false;
+	}
+	Function * checked_function(Value func_val, int passed_arg_count)
+	{
+		func_val.assert_is(TYPE_FUNCTION);
+		auto func = func_val.get_function();
+		if (passed_arg_count != func->parameter_count) {
+			error("Function takes %d arguments; was passed %d",
+				  func->parameter_count,
+				  passed_arg_count);
+		}
+		return func;
+	}
+	// Fetches the function a CALL_KNOWN refers to. The compiler has
+	// already made sure it can only ever be one function, with the
+	// right number of parameters.
+	Function * known_function(BC * bc)
+	{
+		auto globals = frame_reference()->globals;
+		auto cache = &bc->arg.global;
+		if (cache->index < 0 ||
+			cache->index >= globals->names.size ||
+			globals->names[cache->index] != Intern::id_of(cache->symbol)) {
+			cache->index = globals->index_of(cache->symbol);
+			if (cache->index < 0) {
+				error("Variable '%s' is not bound", cache->symbol);
+			}
+		}
+		auto value = globals->values[cache->index];
+		assert(value.is(TYPE_FUNCTION));
+		return value.get_function();
+	}
+	// Slides a tail call's arguments down over what's left of the
+	// current frame, then gives up its place on the call stack
+	void replace_frame(Call_Frame * frame, size_t arg_count)
+	{
+		size_t args_start = stack.size - arg_count;
+		memmove(stack.arr + frame->base, stack.arr + args_start,
+				sizeof(Value) * arg_count);
+		stack.size = frame->base + arg_count;
+		return_function();
+	}
 	void return_function()
 	{
-		GC::heuristic_return();
-		auto frame = call_stack.pop();
-		frame->destroy();
-		free(frame);
+		assert(call_stack.size > 0);
+		call_stack.size--;
 	}
 	Call_Frame * frame_reference()
 	{
 		assert(call_stack.size > 0);
-		return call_stack[call_stack.size - 1];
+		return &call_stack[call_stack.size - 1];
 	}
 	void create_binding(Symbol symbol, Value value)
 	{
@@ -166,16 +285,10 @@ struct VM {
 	{
 		auto frame = frame_reference();
 		Value value;
+		// Every environment chain ends in its file's globals
 		if (frame->environment->resolve_binding(symbol, &value)) {
 			return value;
 		}
-		// TODO(pixlark): Make it so that every environment implicity
-		// links to the global environment, thus removing the need for
-		// this call frame?
-		auto global = call_stack[0];
-		if (global->environment->resolve_binding(symbol, &value)) {
-			return value;
-		}
 		// Finally, check in our export scope
 		if (export_scope->resolve_binding(symbol, &value)) {
 			return value;
@@ -183,16 +296,49 @@ struct VM {
 		error("Variable '%s' is not bound", symbol);
 		assert(false); // @linter
 	}
-	Value lookup_call_flag(Symbol symbol)
+	void update_binding(Symbol symbol, Value value)
 	{
-		for (int i = call_stack.size - 1; i >= 0; i--) {
-			auto frame = call_stack[i];
-			Value value;
-			if (frame->call_flags->resolve_binding(symbol, &value)) {
-				return value;
-			}
+		auto frame = frame_reference();
+		if (!frame->environment->update_binding(symbol, value)) {
+			error("Tried to set unbound variable '%s'", symbol);
 		}
+	}
+	Object * checked_object(Value obj_val)
+	{
+		if (!obj_val.is(TYPE_OBJECT)) {
+			error("Cannot access field of non-object");
+		}
+		return obj_val.get_object();
+	}
+	int field_index(Object * object, Symbol symbol)
+	{
+		int index = object->shape->index_of(symbol);
+		if (index < 0) {
+			error("No such field %s on object", symbol);
+		}
+		return index;
+	}
+	// Looks the field up again only if the object isn't the same shape
+	// as the last one this instruction saw
+	int cached_field_index(Object * object, BC * bc)
+	{
+		auto cache = &bc->arg.field;
+		if (object->shape != cache->shape) {
+			cache->index = field_index(object, cache->symbol);
+			cache->shape = object->shape;
+		}
+		return cache->index;
+	}
+	void update_field(Object * object, int index, Value value)
+	{
+		object->fields[index].store(value);
+		GC::write_barrier(object);
+	}
+	// Nothing sets call flags yet, so there's never one to find
+	Value lookup_call_flag(Symbol symbol)
+	{
 		error("Call flag '%s' is not bound", symbol);
+		assert(false); // @linter
 	}
 	void do_halting_tasks()
 	{
@@ -205,354 +351,530 @@ struct VM {
 		}
 		// Clear out the stack so that the garbage
 		// collector can clean everything up
-		size_t remaining = stack.size;
-		for (int i = 0; i < remaining; i++) {
-			pop();
-		}
+		stack.size = 0;
 	}
-	VM_Response step()
-	{	
+	/* The interpreter loop. Instructions run back-to-back until we
+	 * reach a point where the driver has to get involved: a
+	 * collection is due, a file unit needs its own VM, or we've
+	 * halted. Every block ends in a RETURN (see
+	 * Compiler::finalize), so we never need to bounds-check the
+	 * instruction pointer.
+	 */
+	VM_Response run()
+	{
 		if (halted()) {
 			return VM_HALTED;
 		}
-		
-		/* Manage call stack and VM halting */
-		Call_Frame * frame;
-		{
-			frame = frame_reference();
-			
-			// If our call frame has come to an implicit end
-			while (frame->bc_pointer >= frame->bc_length) {
-				assert(stack.size > 0);
 
-				if (call_stack.size == 1) {
-					// If we're about to return from global scope, we
-					// need to do some special stuff
-					do_halting_tasks();
-					return_function();
-					return VM_HALTED;
-				}
-				return_function();
-				
-				// Update frame reference
-				frame = frame_reference();
-			}
+		Call_Frame * frame = frame_reference();
+		BC * ip = frame->bytecode + frame->bc_pointer;
+		BC * bc;
+
+		#define SAVE_FRAME() (frame->bc_pointer = ip - frame->bytecode)
+		#define LOAD_FRAME() (frame = frame_reference(), \
+							  ip = frame->bytecode + frame->bc_pointer)
+		// Collections can only happen between instructions, when
+		// everything live is reachable from the VM
+		#define SAFEPOINT()								\
+			do {										\
+				if (GC::should_collect()) {				\
+					SAVE_FRAME();						\
+					return VM_COLLECT;					\
+				}										\
+			} while (0)
+
+		#if THREADED_DISPATCH
+		static void * dispatch_table[] = {
+			[BC_NOP] = &&op_BC_NOP,
+			[BC_POP_AND_DISCARD] = &&op_BC_POP_AND_DISCARD,
+			[BC_LOAD_CONST] = &&op_BC_LOAD_CONST,
+			[BC_DUPLICATE] = &&op_BC_DUPLICATE,
+			[BC_CREATE_BINDING] = &&op_BC_CREATE_BINDING,
+			[BC_UPDATE_BINDING] = &&op_BC_UPDATE_BINDING,
+			[BC_RESOLVE_BINDING] = &&op_BC_RESOLVE_BINDING,
+			[BC_LOAD_LOCAL] = &&op_BC_LOAD_LOCAL,
+			[BC_STORE_LOCAL] = &&op_BC_STORE_LOCAL,
+			[BC_LOAD_FRAME] = &&op_BC_LOAD_FRAME,
+			[BC_STORE_FRAME] = &&op_BC_STORE_FRAME,
+			[BC_ADD] = &&op_BC_ADD,
+			[BC_SUBTRACT] = &&op_BC_SUBTRACT,
+			[BC_MULTIPLY] = &&op_BC_MULTIPLY,
+			[BC_DIVIDE] = &&op_BC_DIVIDE,
+			[BC_NEGATE] = &&op_BC_NEGATE,
+			[BC_MOD] = &&op_BC_MOD,
+			[BC_ABS] = &&op_BC_ABS,
+			[BC_EQUAL] = &&op_BC_EQUAL,
+			[BC_NOT_EQUAL] = &&op_BC_NOT_EQUAL,
+			[BC_GREATER_THAN] = &&op_BC_GREATER_THAN,
+			[BC_LESS_THAN] = &&op_BC_LESS_THAN,
+			[BC_GREATER_THAN_OR_EQUAL_TO] = &&op_BC_GREATER_THAN_OR_EQUAL_TO,
+			[BC_LESS_THAN_OR_EQUAL_TO] = &&op_BC_LESS_THAN_OR_EQUAL_TO,
+			[BC_ADD_INT] = &&op_BC_ADD_INT,
+			[BC_SUBTRACT_INT] = &&op_BC_SUBTRACT_INT,
+			[BC_MULTIPLY_INT] = &&op_BC_MULTIPLY_INT,
+			[BC_DIVIDE_INT] = &&op_BC_DIVIDE_INT,
+			[BC_EQUAL_INT] = &&op_BC_EQUAL_INT,
+			[BC_NOT_EQUAL_INT] = &&op_BC_NOT_EQUAL_INT,
+			[BC_GREATER_THAN_INT] = &&op_BC_GREATER_THAN_INT,
+			[BC_LESS_THAN_INT] = &&op_BC_LESS_THAN_INT,
+			[BC_GREATER_THAN_OR_EQUAL_TO_INT] = &&op_BC_GREATER_THAN_OR_EQUAL_TO_INT,
+			[BC_LESS_THAN_OR_EQUAL_TO_INT] = &&op_BC_LESS_THAN_OR_EQUAL_TO_INT,
+			[BC_ADD_INT_UNCHECKED] = &&op_BC_ADD_INT_UNCHECKED,
+			[BC_SUBTRACT_INT_UNCHECKED] = &&op_BC_SUBTRACT_INT_UNCHECKED,
+			[BC_MULTIPLY_INT_UNCHECKED] = &&op_BC_MULTIPLY_INT_UNCHECKED,
+			[BC_DIVIDE_INT_UNCHECKED] = &&op_BC_DIVIDE_INT_UNCHECKED,
+			[BC_EQUAL_INT_UNCHECKED] = &&op_BC_EQUAL_INT_UNCHECKED,
+			[BC_NOT_EQUAL_INT_UNCHECKED] = &&op_BC_NOT_EQUAL_INT_UNCHECKED,
+			[BC_GREATER_THAN_INT_UNCHECKED] = &&op_BC_GREATER_THAN_INT_UNCHECKED,
+			[BC_LESS_THAN_INT_UNCHECKED] = &&op_BC_LESS_THAN_INT_UNCHECKED,
+			[BC_GREATER_THAN_OR_EQUAL_TO_INT_UNCHECKED] = &&op_BC_GREATER_THAN_OR_EQUAL_TO_INT_UNCHECKED,
+			[BC_LESS_THAN_OR_EQUAL_TO_INT_UNCHECKED] = &&op_BC_LESS_THAN_OR_EQUAL_TO_INT_UNCHECKED,
+			[BC_CONSTRUCT_FUNCTION] = &&op_BC_CONSTRUCT_FUNCTION,
+			[BC_POP_AND_CALL_FUNCTION] = &&op_BC_POP_AND_CALL_FUNCTION,
+			[BC_TAIL_CALL] = &&op_BC_TAIL_CALL,
+			[BC_CALL_KNOWN] = &&op_BC_CALL_KNOWN,
+			[BC_TAIL_CALL_KNOWN] = &&op_BC_TAIL_CALL_KNOWN,
+			[BC_RETURN] = &&op_BC_RETURN,
+			[BC_THIS_FUNCTION] = &&op_BC_THIS_FUNCTION,
+			[BC_SYMBOL_TO_STRING] = &&op_BC_SYMBOL_TO_STRING,
+			[BC_AND] = &&op_BC_AND,
+			[BC_OR] = &&op_BC_OR,
+			[BC_NOT] = &&op_BC_NOT,
+			[BC_JUMP] = &&op_BC_JUMP,
+			[BC_POP_JUMP] = &&op_BC_POP_JUMP,
+			[BC_ENTER_SCOPE] = &&op_BC_ENTER_SCOPE,
+			[BC_EXIT_SCOPE] = &&op_BC_EXIT_SCOPE,
+			[BC_CONSTRUCT_CONSTRUCTOR] = &&op_BC_CONSTRUCT_CONSTRUCTOR,
+			[BC_RESOLVE_FIELD] = &&op_BC_RESOLVE_FIELD,
+			[BC_UPDATE_FIELD] = &&op_BC_UPDATE_FIELD,
+			[BC_ARRAY_GET] = &&op_BC_ARRAY_GET,
+			[BC_ARRAY_SET] = &&op_BC_ARRAY_SET,
+			[BC_ARRAY_PUSH] = &&op_BC_ARRAY_PUSH,
+			[BC_ARRAY_LEN] = &&op_BC_ARRAY_LEN,
+			[BC_RUN_FILE_UNIT] = &&op_BC_RUN_FILE_UNIT,
+			[BC_EXPORT_SYMBOL] = &&op_BC_EXPORT_SYMBOL,
+			[BC_GET_CALL_FLAG] = &&op_BC_GET_CALL_FLAG,
+			[BC_RESOLVE_SYM] = &&op_BC_RESOLVE_SYM,
+			[BC_LET_SYM] = &&op_BC_LET_SYM,
+			[BC_SET_SYM] = &&op_BC_SET_SYM,
+			[BC_GET_FIELD_SYM] = &&op_BC_GET_FIELD_SYM,
+			[BC_SET_FIELD_SYM] = &&op_BC_SET_FIELD_SYM,
+		};
+		static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == BC_KIND_COUNT,
+					  "dispatch_table is out of sync with BC_Kind");
+		#define CASE(kind) op_##kind
+		#define NEXT()									\
+			do {										\
+				bc = ip++;								\
+				current_assoc = bc->assoc;				\
+				goto *dispatch_table[bc->kind];			\
+			} while (0)
+		NEXT();
+		#else
+		#define CASE(kind) case kind
+		#define NEXT() goto dispatch
+	dispatch:
+		bc = ip++;
+		current_assoc = bc->assoc;
+		switch (bc->kind) {
+		#endif
+
+		CASE(BC_NOP): {
+			NEXT();
 		}
-		
-		BC bc = frame->bytecode[frame->bc_pointer++];
-		current_assoc = bc.assoc;
-		
-		switch (bc.kind) {
-		case BC_NOP: break;
-		case BC_POP_AND_DISCARD: {
+		CASE(BC_POP_AND_DISCARD): {
 			pop();
-		} break;
-		case BC_LOAD_CONST: {
-			push(bc.arg.value);
-		} break;
-		case BC_DUPLICATE: {
+			NEXT();
+		}
+		CASE(BC_LOAD_CONST): {
+			push(bc->arg.value);
+			NEXT();
+		}
+		CASE(BC_DUPLICATE): {
 			push(stack[stack.size - 1]);
-		} break;
-		case BC_CREATE_BINDING: {
+			NEXT();
+		}
+		CASE(BC_CREATE_BINDING): {
 			auto symbol = pop_symbol();
 			auto value = pop();
 			create_binding(symbol, value);
-		} break;
-		case BC_UPDATE_BINDING: {
+			NEXT();
+		}
+		CASE(BC_UPDATE_BINDING): {
 			auto symbol = pop_symbol();
 			auto value = pop();
-			if (!frame->environment->update_binding(symbol, value)) {
-				error("Tried to set unbound variable '%s'", symbol);
-			}
-		} break;
-		case BC_RESOLVE_BINDING: {
+			update_binding(symbol, value);
+			NEXT();
+		}
+		CASE(BC_RESOLVE_BINDING): {
 			auto symbol = pop_symbol();
 			auto value = resolve_binding(symbol);
 			push(value);
-		} break;
-		case BC_ADD: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::add(a, b, bc.assoc));
-		} break;
-		case BC_SUBTRACT: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::subtract(a, b, bc.assoc));
-		} break;
-		case BC_MULTIPLY: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::multiply(a, b, bc.assoc));
-		} break;
-		case BC_DIVIDE: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::divide(a, b, bc.assoc));
-		} break;
-		case BC_NEGATE: {
-			auto a = pop();
-			push(Value::subtract(Value::raise(0), a, bc.assoc));
-		} break;
-		case BC_EQUAL: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::raise_bool(Value::equal(a, b, bc.assoc)));
-		} break;
-		case BC_NOT_EQUAL: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::raise_bool(!Value::equal(a, b, bc.assoc)));
-		} break;
-		case BC_GREATER_THAN: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::raise_bool(Value::greater_than(a, b, bc.assoc)));
-		} break;
-		case BC_LESS_THAN: {
-			auto b = pop();
-			auto a = pop();
-			push(Value::raise_bool(Value::less_than(a, b, bc.assoc)));
-		} break;
-		case BC_GREATER_THAN_OR_EQUAL_TO: {
-			auto b = pop();
+			NEXT();
+		}
+		CASE(BC_LOAD_LOCAL): {
+			auto env = frame->environment->ancestor(bc->arg.local.depth);
+			auto value = env->slots[bc->arg.local.slot];
+			if (value.is_unset()) {
+				error("Variable read before it was bound");
+			}
+			push(value);
+			NEXT();
+		}
+		CASE(BC_STORE_LOCAL): {
+			auto env = frame->environment->ancestor(bc->arg.local.depth);
+			env->slots[bc->arg.local.slot].store(pop());
+			GC::write_barrier(env);
+			NEXT();
+		}
+		CASE(BC_LOAD_FRAME): {
+			push(stack[frame->base + bc->arg.local.slot]);
+			NEXT();
+		}
+		CASE(BC_STORE_FRAME): {
+			auto value = pop();
+			stack[frame->base + bc->arg.local.slot] = value;
+			NEXT();
+		}
+		/* Arithmetic and comparisons quicken themselves: once one of
+		 * these sees two integers, it rewrites itself in place to its
+		 * _INT form, which only has to check a guard before doing the
+		 * integer operation. If the guard ever fails, it rewrites
+		 * itself back and does things the slow way.
+		 *
+		 * The _INT_UNCHECKED forms are only emitted where the compiler
+		 * has proven both operands are integers, so they skip the
+		 * guard altogether.
+		 */
+		#define QUICKENING_BINARY(generic, quick, unchecked, generic_result, int_result) \
+			CASE(generic): {											\
+				auto b = pop();											\
+				auto a = pop();											\
+				if (a.is(TYPE_INTEGER) && b.is(TYPE_INTEGER)) {			\
+					bc->kind = quick;									\
+					push(int_result);									\
+				} else {												\
+					push(generic_result);								\
+				}														\
+				NEXT();													\
+			}															\
+			CASE(quick): {												\
+				Value * top = stack.arr + stack.size;					\
+				Value a = top[-2];										\
+				Value b = top[-1];										\
+				if (a.is(TYPE_INTEGER) && b.is(TYPE_INTEGER)) {			\
+					top[-2] = int_result;								\
+					stack.size--;										\
+					NEXT();												\
+				}														\
+				bc->kind = generic;										\
+				stack.size -= 2;										\
+				push(generic_result);									\
+				NEXT();													\
+			}															\
+			CASE(unchecked): {											\
+				Value * top = stack.arr + stack.size;					\
+				Value a = top[-2];										\
+				Value b = top[-1];										\
+				top[-2] = int_result;									\
+				stack.size--;											\
+				NEXT();													\
+			}
+		QUICKENING_BINARY(BC_ADD, BC_ADD_INT, BC_ADD_INT_UNCHECKED,
+						  Value::add(a, b, bc->assoc),
+						  Value::raise(a.get_integer() + b.get_integer()))
+		QUICKENING_BINARY(BC_SUBTRACT, BC_SUBTRACT_INT, BC_SUBTRACT_INT_UNCHECKED,
+						  Value::subtract(a, b, bc->assoc),
+						  Value::raise(a.get_integer() - b.get_integer()))
+		QUICKENING_BINARY(BC_MULTIPLY, BC_MULTIPLY_INT, BC_MULTIPLY_INT_UNCHECKED,
+						  Value::multiply(a, b, bc->assoc),
+						  Value::raise(a.get_integer() * b.get_integer()))
+		QUICKENING_BINARY(BC_DIVIDE, BC_DIVIDE_INT, BC_DIVIDE_INT_UNCHECKED,
+						  Value::divide(a, b, bc->assoc),
+						  Value::raise(a.get_integer() / b.get_integer()))
+		CASE(BC_NEGATE): {
 			auto a = pop();
-			push(Value::raise_bool(Value::greater_than_or_equal_to(a, b, bc.assoc)));
-		} break;
-		case BC_LESS_THAN_OR_EQUAL_TO: {
+			push(Value::subtract(Value::raise(0), a, bc->assoc));
+			NEXT();
+		}
+		CASE(BC_MOD): {
+			auto n = pop();
 			auto b = pop();
-			auto a = pop();
-			push(Value::raise_bool(Value::less_than_or_equal_to(a, b, bc.assoc)));
-		} break;
-		case BC_AND: {
+			if (!n.is(TYPE_INTEGER) || !b.is(TYPE_INTEGER)) {
+				error("FFI function mod() takes integers");
+			}
+			push(Value::raise(n.get_integer() % b.get_integer()));
+			NEXT();
+		}
+		CASE(BC_ABS): {
+			auto n = pop();
+			if (!n.is(TYPE_INTEGER)) {
+				error("Builtin function abs() takes integer");
+			}
+			push(Value::raise(abs(n.get_integer())));
+			NEXT();
+		}
+		QUICKENING_BINARY(BC_EQUAL, BC_EQUAL_INT, BC_EQUAL_INT_UNCHECKED,
+						  Value::raise_bool(Value::equal(a, b, bc->assoc)),
+						  Value::raise_bool(a.get_integer() == b.get_integer()))
+		QUICKENING_BINARY(BC_NOT_EQUAL, BC_NOT_EQUAL_INT, BC_NOT_EQUAL_INT_UNCHECKED,
+						  Value::raise_bool(!Value::equal(a, b, bc->assoc)),
+						  Value::raise_bool(a.get_integer() != b.get_integer()))
+		QUICKENING_BINARY(BC_GREATER_THAN, BC_GREATER_THAN_INT, BC_GREATER_THAN_INT_UNCHECKED,
+						  Value::raise_bool(Value::greater_than(a, b, bc->assoc)),
+						  Value::raise_bool(a.get_integer() > b.get_integer()))
+		QUICKENING_BINARY(BC_LESS_THAN, BC_LESS_THAN_INT, BC_LESS_THAN_INT_UNCHECKED,
+						  Value::raise_bool(Value::less_than(a, b, bc->assoc)),
+						  Value::raise_bool(a.get_integer() < b.get_integer()))
+		QUICKENING_BINARY(BC_GREATER_THAN_OR_EQUAL_TO, BC_GREATER_THAN_OR_EQUAL_TO_INT, BC_GREATER_THAN_OR_EQUAL_TO_INT_UNCHECKED,
+						  Value::raise_bool(Value::greater_than_or_equal_to(a, b, bc->assoc)),
+						  Value::raise_bool(a.get_integer() >= b.get_integer()))
+		QUICKENING_BINARY(BC_LESS_THAN_OR_EQUAL_TO, BC_LESS_THAN_OR_EQUAL_TO_INT, BC_LESS_THAN_OR_EQUAL_TO_INT_UNCHECKED,
+						  Value::raise_bool(Value::less_than_or_equal_to(a, b, bc->assoc)),
+						  Value::raise_bool(a.get_integer() <= b.get_integer()))
+		CASE(BC_AND): {
 			auto b = pop();
 			auto a = pop();
-			push(Value::raise_bool(Value::_and(a, b, bc.assoc)));
-		} break;
-		case BC_OR: {
+			push(Value::raise_bool(Value::_and(a, b, bc->assoc)));
+			NEXT();
+		}
+		CASE(BC_OR): {
 			auto b = pop();
 			auto a = pop();
-			push(Value::raise_bool(Value::_or(a, b, bc.assoc)));
-		} break;
-		case BC_NOT: {
+			push(Value::raise_bool(Value::_or(a, b, bc->assoc)));
+			NEXT();
+		}
+		CASE(BC_NOT): {
 			auto a = pop();
 			push(Value::raise_bool(!a.truthy()));
-		} break;
-		case BC_CONSTRUCT_FUNCTION: {
+			NEXT();
+		}
+		CASE(BC_CONSTRUCT_FUNCTION): {
 			auto count = pop_integer();
 			
 			Function * func = (Function*) GC::alloc(sizeof(Function));
-			func->block_reference = bc.arg.block_reference;
-
-			// Insert parameters
+			func->block_reference = bc->arg.block_reference;
 			func->parameter_count = count;
-			func->parameters = (Symbol*) GC::alloc(sizeof(Symbol) * count);
-			for (int i = 0; i < count; i++) {
-				auto it = pop_symbol();
-				func->parameters[count - i - 1] = it;
-			}
 
 			// Close over local environment
 			func->closure = frame->environment;
+			func->globals = frame->globals;
 			
-			// Create and push value
-			Value value = Value::create(TYPE_FUNCTION);
-			value.ref_function = func;
-			push(value);
-		} break;
-		case BC_POP_AND_CALL_FUNCTION: {
+			push(Value::raise(func));
+			NEXT();
+		}
+		CASE(BC_POP_AND_CALL_FUNCTION): {
 			auto func_val = pop();
-			if (func_val.is(TYPE_BUILTIN)) {
-				// If this is a builtin function, override everything and just do a builtin call
-				auto builtin = func_val.builtin;
-				auto passed_arg_count = pop_integer();
-				if (passed_arg_count != builtin->arg_count) {
-					error("Function takes %d arguments; was passed %d",
-						  builtin->arg_count,
-						  passed_arg_count);
-				}
-				Value * args = (Value*) malloc(sizeof(Value) * builtin->arg_count);
-				defer { free(args); };
-				for (int i = 0; i < builtin->arg_count; i++) {
-					args[i] = pop();
-				}
-				push((builtin->funcptr)(args));
-			} else if (func_val.is(TYPE_CONSTRUCTOR)) {
-				auto ctor = func_val.ref_constructor;
-				auto object = (Object*) GC::alloc(sizeof(Object));
-				object->fields.alloc(symbol_comparator);
-
-				auto passed_arg_count = pop_integer();
-				if (passed_arg_count != ctor->field_count) {
-					error("Constructor has %d fields; was passed %d",
-						  ctor->field_count,
-						  passed_arg_count);
-				}
-
-				for (int i = 0; i < ctor->field_count; i++) {
-					auto val = pop();
-					auto symbol = ctor->fields[i];
-					object->fields.add(symbol, val);
-				}
-
-				auto val = Value::create(TYPE_OBJECT);
-				val.ref_object = object;
-				push(val);
-			} else {
-				// Otherwise, this is a normal function
-				func_val.assert_is(TYPE_FUNCTION);
-				auto func = func_val.ref_function;
-				auto passed_arg_count = pop_integer();
-				if (passed_arg_count != func->parameter_count) {
-					error("Function takes %d arguments; was passed %d",
-						  func->parameter_count,
-						  passed_arg_count);
-				}
-
-				#if TAIL_CALL_OPTIMIZATION
-				{
-					bool is_tail_call = true;
-					size_t ptr = frame->bc_pointer;
-					while (ptr < frame->bc_length) {
-						auto kind = frame->bytecode[ptr].kind;
-						if (kind == BC_RETURN) {
-							break;
-						}
-						if (!BC::tail_call_safe(kind)) {
-							is_tail_call = false;
-							break;
-						}
-						ptr++;
-					}
-					if (is_tail_call) {
-						return_function();
-					}
-				}
-				#endif
-				
-				// Create our new call frame
-				call_stack.push(Call_Frame::alloc(blocks, func->block_reference,
-												  func, func->closure));
-				
-				// Create bindings to pushed arguments
-				for (int i = 0; i < passed_arg_count; i++) {
-					auto value = pop();
-					create_binding(func->parameters[i], value);
-				}
+			auto passed_arg_count = pop_integer();
+			if (call_native(func_val, passed_arg_count)) {
+				NEXT();
+			}
+			auto func = checked_function(func_val, passed_arg_count);
+			SAVE_FRAME();
+			push_frame(func, passed_arg_count);
+			LOAD_FRAME();
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_TAIL_CALL): {
+			auto func_val = pop();
+			auto passed_arg_count = pop_integer();
+			if (call_native(func_val, passed_arg_count)) {
+				NEXT();
+			}
+			auto func = checked_function(func_val, passed_arg_count);
+			replace_frame(frame, passed_arg_count);
+			push_frame(func, passed_arg_count);
+			LOAD_FRAME();
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_CALL_KNOWN): {
+			auto func = known_function(bc);
+			SAVE_FRAME();
+			push_frame(func, func->parameter_count);
+			LOAD_FRAME();
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_TAIL_CALL_KNOWN): {
+			auto func = known_function(bc);
+			replace_frame(frame, func->parameter_count);
+			push_frame(func, func->parameter_count);
+			LOAD_FRAME();
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_RETURN): {
+			if (call_stack.size == 1) {
+				// If we're about to return from global scope, we
+				// need to do some special stuff
+				assert(stack.size > 0);
+				do_halting_tasks();
+				return_function();
+				return VM_HALTED;
 			}
-		} break;
-		case BC_RETURN: {
-			// WARNING: `frame` invalidated here! Don't use it!
+			// Drop the frame's slots and anything else it left behind
+			auto result = pop();
+			stack.size = frame->base;
+			push(result);
 			return_function();
-		} break;
-		case BC_THIS_FUNCTION: {
-			auto func = Value::create(TYPE_FUNCTION);
+			LOAD_FRAME();
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_THIS_FUNCTION): {
 			if (!frame->origin) {
 				error("Invalid use of this -- not in a function!");
 			}
-			func.ref_function = frame->origin;
-			push(func);
-		} break;
-		case BC_SYMBOL_TO_STRING: {
+			push(Value::raise(frame->origin));
+			NEXT();
+		}
+		CASE(BC_SYMBOL_TO_STRING): {
 			auto symbol = pop_symbol();
 			auto string = (String*) GC::alloc(sizeof(String));
 			string->length = strlen(symbol);
 			string->string = (char*) GC::alloc(sizeof(char) * string->length);
 			strncpy(string->string, symbol, string->length);
-			auto value = Value::create(TYPE_STRING);
-			value.ref_string = string;
-			push(value);
-		} break;
-		case BC_JUMP: {
-			frame->bc_pointer = bc.arg.integer;
-		} break;
-		case BC_POP_JUMP: {
+			push(Value::raise(string));
+			NEXT();
+		}
+		CASE(BC_JUMP): {
+			ip = frame->bytecode + bc->arg.integer;
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_POP_JUMP): {
 			auto a = pop();
-			if (a.type != TYPE_NOTHING) {
-				frame->bc_pointer = bc.arg.integer;
+			if (a.truthy()) {
+				ip = frame->bytecode + bc->arg.integer;
+				SAFEPOINT();
 			}
-		} break;
-		case BC_ENTER_SCOPE: {
-			auto new_env = Environment::alloc();
+			NEXT();
+		}
+		CASE(BC_ENTER_SCOPE): {
+			auto new_env = Environment::alloc_slots(bc->arg.integer);
 			new_env->next_env = frame->environment;
+			GC::write_barrier(new_env);
 			frame->environment = new_env;
-		} break;
-		case BC_EXIT_SCOPE: {
+			NEXT();
+		}
+		CASE(BC_EXIT_SCOPE): {
 			frame->environment = frame->environment->next_env;
-			GC::heuristic_exit_scope();
-		} break;
-		case BC_CONSTRUCT_CONSTRUCTOR: {
+			SAFEPOINT();
+			NEXT();
+		}
+		CASE(BC_CONSTRUCT_CONSTRUCTOR): {
 			auto count = pop_integer();
-			auto ctor = (Constructor*) GC::alloc(sizeof(Constructor));
-			ctor->fields = (Symbol*) GC::alloc(sizeof(Symbol) * count);
-			ctor->field_count = count;
+			// Not deferred, since NEXT() doesn't run destructors
+			auto fields = (Symbol_ID*) malloc(sizeof(Symbol_ID) * count);
 			for (int i = 0; i < count; i++) {
-				ctor->fields[i] = pop_symbol();
+				fields[i] = Intern::id_of(pop_symbol());
 			}
-			auto val = Value::create(TYPE_CONSTRUCTOR);
-			val.ref_constructor = ctor;
-			push(val);
-		} break;
-		case BC_RESOLVE_FIELD: {
+			auto ctor = (Constructor*) GC::alloc(sizeof(Constructor));
+			ctor->shape = Shapes::of(fields, count);
+			free(fields);
+			push(Value::raise(ctor));
+			NEXT();
+		}
+		CASE(BC_RESOLVE_FIELD): {
 			auto symbol = pop_symbol();
-			auto obj_val = pop();
-			if (!obj_val.is(TYPE_OBJECT)) {
-				error("Cannot access field of non-object");
-			}
-			auto obj = obj_val.ref_object;
-			if (!obj->fields.bound(symbol)) {
-				error("No such field %s on object", symbol);
-			}
-			auto resolved = obj->fields.lookup(symbol);
-			push(resolved);
-		} break;
-		case BC_UPDATE_FIELD: {
+			auto object = checked_object(pop());
+			push(object->fields[field_index(object, symbol)]);
+			NEXT();
+		}
+		CASE(BC_UPDATE_FIELD): {
 			auto symbol = pop_symbol();
-			auto obj_val = pop();
-			if (!obj_val.is(TYPE_OBJECT)) {
-				error("Cannot access field of non-object");
-			}
-			auto obj = obj_val.ref_object;
-			if (!obj->fields.bound(symbol)) {
-				error("No such field %s on object", symbol);
-			}
+			auto object = checked_object(pop());
 			auto val = pop();
-			obj->fields.update(symbol, val);
-		} break;
-		case BC_PUSH_BODY: {
-			frame->body_stack.push(bc.arg.integer);
-		} break;
-		case BC_BREAK_BODY: {
-			if (frame->body_stack.size == 0) {
-				error("Nothing to break out of");
-			}
-			int exit_pos = frame->body_stack.pop();
-			frame->bc_pointer = exit_pos;
-		} break;
-		case BC_RUN_FILE_UNIT: {
+			update_field(object, field_index(object, symbol), val);
+			NEXT();
+		}
+		CASE(BC_ARRAY_GET): {
+			auto array = Array::checked(pop(), "array_get", bc->assoc);
+			auto index = array->checked_index(pop(), bc->assoc);
+			push(array->get(index));
+			NEXT();
+		}
+		CASE(BC_ARRAY_SET): {
+			auto array = Array::checked(pop(), "array_set", bc->assoc);
+			auto index = array->checked_index(pop(), bc->assoc);
+			array->set(index, pop());
+			push(Value::nothing());
+			NEXT();
+		}
+		CASE(BC_ARRAY_PUSH): {
+			auto array = Array::checked(pop(), "array_push", bc->assoc);
+			array->push(pop());
+			push(Value::nothing());
+			NEXT();
+		}
+		CASE(BC_ARRAY_LEN): {
+			auto array = Array::checked(pop(), "array_len", bc->assoc);
+			push(Value::raise((int) array->length()));
+			NEXT();
+		}
+		CASE(BC_RUN_FILE_UNIT): {
 			block_reference_to_push = pop_integer();
 			push(Value::nothing());
+			SAVE_FRAME();
 			return VM_SWITCH;
-		} break;
-		case BC_EXPORT_SYMBOL: {
+		}
+		CASE(BC_EXPORT_SYMBOL): {
 			auto symbol = pop_symbol();
-			export_queue.push((Export) { symbol, bc.assoc });
+			export_queue.push((Export) { symbol, bc->assoc });
 			push(Value::nothing());
-		} break;
-		case BC_GET_CALL_FLAG: {
-			auto symbol_val = bc.arg.value;
+			NEXT();
+		}
+		CASE(BC_GET_CALL_FLAG): {
+			auto symbol_val = bc->arg.value;
 			if (!symbol_val.is(TYPE_SYMBOL)) {
 				fatal("Can't lookup call-flag for non-symbol. (This error should never trigger!)");
 			}
-			auto symbol = symbol_val.symbol;
+			auto symbol = symbol_val.get_symbol();
 			push(lookup_call_flag(symbol));
-		} break;
+			NEXT();
+		}
+		CASE(BC_RESOLVE_SYM): {
+			push(resolve_binding(bc->arg.value.get_symbol()));
+			NEXT();
+		}
+		CASE(BC_LET_SYM): {
+			auto value = pop();
+			create_binding(bc->arg.value.get_symbol(), value);
+			NEXT();
+		}
+		CASE(BC_SET_SYM): {
+			auto value = pop();
+			update_binding(bc->arg.value.get_symbol(), value);
+			NEXT();
+		}
+		CASE(BC_GET_FIELD_SYM): {
+			auto object = checked_object(pop());
+			push(object->fields[cached_field_index(object, bc)]);
+			NEXT();
+		}
+		CASE(BC_SET_FIELD_SYM): {
+			auto object = checked_object(pop());
+			auto val = pop();
+			update_field(object, cached_field_index(object, bc), val);
+			NEXT();
+		}
+
+		#if !THREADED_DISPATCH
 		default: {
 			fatal("Internal error: VM ran unrecognized instruction");
 		}
 		}
+		#endif
 
-		return VM_OK;
+		#undef QUICKENING_BINARY
+		#undef NEXT
+		#undef CASE
+		#undef SAFEPOINT
+		#undef LOAD_FRAME
+		#undef SAVE_FRAME
+		assert(false); // @linter
 	}
 	void print_debug_info()
 	{
@@ -596,18 +918,23 @@ struct VM {
 		printf(".............\n");
 		printf("    Vars\n");
 		for (int i = call_stack.size - 1; i >= 0; i--) {
-			auto frame = call_stack[i];
+			auto frame = &call_stack[i];
 			auto env = frame->environment;
 			int index = 0;
 			while (env) {
 				for (int j = 0; j < env->names.size; j++) {
-					auto sym = env->names[j];
+					auto sym = Intern::symbol_of(env->names[j]);
 					Value val;
 					env->resolve_binding(sym, &val);
 					char * s = val.to_string();
 					defer { free(s); };
 					printf("%s: %s\n", sym, s);
 				}
+				for (int j = 0; j < env->slot_count; j++) {
+					char * s = env->slots[j].to_string();
+					defer { free(s); };
+					printf("%d:%d: %s\n", index, j, s);
+				}
 				env = env->next_env;
 				index++;
 			}
@@ -615,16 +942,6 @@ struct VM {
 				printf("      .\n");
 			}
 		}
-		/*
-		printf(".............\n");
-		{
-			printf("Bodies: ");
-			auto frame = frame_reference();
-			for (int i = 0; i < frame->body_stack.size; i++) {
-				printf("%d ", frame->body_stack[i]);
-			}
-			printf("\n");
-			}*/
 		printf("-------------\n\n");
 	}
 };